@@ -0,0 +1,175 @@
+/*
+    Config lookup benchmark.
+    Reader threads look up commands while writer reloads config every
+    millisecond. Compares std::map guarded by boost::shared_mutex
+    (previous lookup path) with CommandTable snapshots in ConfigStore.
+    Reports lookups per second and reload latency.
+
+    USAGE: config-bench [threads ...]
+*/
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+
+#include <boost/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/ConfigStore.h"
+
+const size_t commands_count = 200;
+const auto run_time = std::chrono::milliseconds(500);
+const auto reload_period = std::chrono::milliseconds(1);
+
+typedef std::chrono::steady_clock clock_type;
+
+config_data_type make_config() {
+    config_data_type config;
+    for (size_t i = 0; i < commands_count; ++i) {
+        CommandConfig command;
+        command.program = "/usr/bin/command-" + std::to_string(i);
+        config["command-" + std::to_string(i)] = command;
+    }
+    return config;
+}
+
+std::vector<std::string> make_lookups() {
+    // Mostly allowed commands with some misses
+    std::vector<std::string> lookups;
+    for (size_t i = 0; i < commands_count + commands_count / 4; ++i) {
+        lookups.push_back("command-" + std::to_string((i * 7919) % (commands_count + commands_count / 4)));
+    }
+    return lookups;
+}
+
+class LegacyConfig {
+public:
+    LegacyConfig(const config_data_type& config) : config_(config) {}
+
+    bool lookup(const std::string& cmd, CommandConfig& config) {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        auto found = config_.find(cmd) != config_.end();
+        if (found) {
+            config = config_.at(cmd);
+        }
+        return found;
+    }
+
+    void reload(const config_data_type& config) {
+        // Config was parsed under writer lock
+        boost::unique_lock<boost::shared_mutex> lock(mutex_);
+        config_ = config;
+    }
+
+private:
+    config_data_type config_;
+    boost::shared_mutex mutex_;
+};
+
+class SnapshotConfig {
+public:
+    SnapshotConfig(const config_data_type& config)
+        : store_(std::make_shared<CommandTable>(config))
+    {}
+
+    bool lookup(const std::string& cmd, CommandConfig& config) {
+        auto found = store_.current().find(cmd);
+        if (found) {
+            config = *found;
+        }
+        return found != nullptr;
+    }
+
+    void reload(const config_data_type& config) {
+        store_.store(std::make_shared<CommandTable>(config));
+    }
+
+private:
+    ConfigStore store_;
+};
+
+struct Result {
+    double lookups_per_second;
+    double average_reload_us;
+    double max_reload_us;
+};
+
+template <typename Config>
+Result run(size_t threads_count) {
+    auto config_data = make_config();
+    auto lookups = make_lookups();
+    Config config(config_data);
+
+    std::atomic<size_t> total_lookups(0);
+    auto start = clock_type::now();
+    auto deadline = start + run_time;
+
+    // Readers check deadline themselves, so run ends even when
+    // writer starves behind them on a machine with few cores
+    boost::thread_group readers;
+    for (size_t i = 0; i < threads_count; ++i) {
+        readers.create_thread([&, i]() {
+            CommandConfig command;
+            size_t count = 0;
+            for (size_t pos = i; (count & 1023) || clock_type::now() < deadline; ++pos) {
+                config.lookup(lookups[pos % lookups.size()], command);
+                ++count;
+            }
+            total_lookups += count;
+        });
+    }
+
+    size_t reloads = 0;
+    double total_reload_us = 0;
+    double max_reload_us = 0;
+
+    while (clock_type::now() < deadline) {
+        auto reload_start = clock_type::now();
+        config.reload(config_data);
+        std::chrono::duration<double, std::micro> reload_time = clock_type::now() - reload_start;
+
+        ++reloads;
+        total_reload_us += reload_time.count();
+        max_reload_us = std::max(max_reload_us, reload_time.count());
+        std::this_thread::sleep_for(reload_period);
+    }
+    readers.join_all();
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+    return Result{total_lookups / elapsed.count(), total_reload_us / reloads, max_reload_us};
+}
+
+void print(const char* name, size_t threads_count, const Result& result) {
+    std::cout << std::setw(10) << name
+        << std::setw(9) << threads_count
+        << std::setw(16) << std::fixed << std::setprecision(0) << result.lookups_per_second
+        << std::setw(16) << std::setprecision(1) << result.average_reload_us
+        << std::setw(16) << result.max_reload_us << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> threads;
+    for (int i = 1; i < argc; ++i) {
+        threads.push_back(boost::lexical_cast<size_t>(argv[i]));
+    }
+    if (threads.empty()) {
+        threads = {1, 2, 4, 8};
+    }
+
+    std::cout << std::setw(10) << "config"
+        << std::setw(9) << "threads"
+        << std::setw(16) << "lookups/s"
+        << std::setw(16) << "avg reload us"
+        << std::setw(16) << "max reload us" << std::endl;
+
+    for (auto threads_count : threads) {
+        print("legacy", threads_count, run<LegacyConfig>(threads_count));
+        print("snapshot", threads_count, run<SnapshotConfig>(threads_count));
+    }
+    return 0;
+}
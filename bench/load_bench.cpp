@@ -0,0 +1,703 @@
+/*
+    End-to-end load generator.
+    Opens many TCP and local socket connections to the daemon, keeps
+    several pipelined commands of a weighted mix in flight on each of them
+    and reports throughput, latency and time-to-first-byte percentiles
+    together with daemon RSS and CPU usage.
+
+    Commands of the mix must be allowed by the daemon config. Default mix:
+        90:echo hello
+        5:head -c 1048576 /dev/zero
+        5:sleep 1
+
+    With -i, idle TCP connections are opened before the run and kept open
+    during it, daemon RSS growth per idle connection is reported.
+    100k idle connections need raised descriptor limits of both processes
+    and a wide local port range.
+
+    USAGE: load-bench [-t <tcp>] [-l <local>] [-q <depth>] [-s <seconds>] [-i <idle>]
+        [-a <address>] [-m <weight>:<command> ...] [-p <pid> | -d <daemon command>]
+*/
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/settings.h"
+#include "../src/ProcessSpawner.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+typedef std::chrono::steady_clock clock_type;
+
+const size_t read_buffer_length = 16384;
+const auto sample_period = boost::posix_time::milliseconds(100);
+// In-flight commands are given this long to finish after the run
+const auto drain_time = std::chrono::seconds(30);
+
+struct Options {
+    size_t tcp_connections;
+    size_t local_connections;
+    // Commands in flight per connection
+    size_t depth;
+    size_t seconds;
+    // Connections which never send anything
+    size_t idle_connections;
+    std::string address;
+    // Pairs of weight and command
+    std::vector<std::pair<size_t, std::string>> mix;
+    pid_t daemon_pid;
+    std::string daemon_command;
+
+    Options()
+        : tcp_connections(500), local_connections(500), depth(4), seconds(10),
+        idle_connections(0), address("127.0.0.1"), daemon_pid(0)
+    {}
+};
+
+/* Per-command counters, shared by all connections of the single io thread */
+struct CommandStats {
+    std::vector<double> latency_us;
+    std::vector<double> first_byte_us;
+    size_t succeeded;
+    size_t failed;
+    size_t invalid;
+
+    CommandStats() : succeeded(0), failed(0), invalid(0) {}
+};
+
+struct LoadStats {
+    std::vector<CommandStats> commands;
+    size_t connected;
+    size_t connect_errors;
+    size_t io_errors;
+    uint64_t bytes_received;
+
+    LoadStats(size_t commands_count)
+        : commands(commands_count), connected(0), connect_errors(0),
+        io_errors(0), bytes_received(0)
+    {}
+};
+
+/* Shared state of one run */
+struct LoadContext {
+    boost::asio::io_service& io_service;
+    const Options& options;
+    LoadStats& stats;
+    std::discrete_distribution<size_t> mix_distribution;
+    clock_type::time_point stop_time;
+    size_t active_connections;
+
+    LoadContext(boost::asio::io_service& io_service, const Options& options, LoadStats& stats)
+        : io_service(io_service), options(options), stats(stats), active_connections(0)
+    {
+        std::vector<size_t> weights;
+        for (auto& entry : options.mix) {
+            weights.push_back(entry.first);
+        }
+        mix_distribution = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+};
+
+/*
+    One client connection. Keeps 'depth' commands in flight until stop time
+    and parses streamed responses:
+        *** STDOUT <id> <length> ***\n<length bytes>
+        *** STDERR <id> <length> ***\n<length bytes>
+        *** STATUS <id> ***\n<message>\n\0
+*/
+template <typename Socket>
+class Connection : public std::enable_shared_from_this<Connection<Socket>> {
+public: // constructors
+
+    Connection(LoadContext& context, size_t seed)
+        : context_(context), socket_(context.io_service), random_(seed),
+        last_request_id_(0), writing_(false), state_(State::header),
+        body_left_(0), status_id_(0)
+    {}
+
+public: // methods
+
+    template <typename Endpoint>
+    void start(const Endpoint& endpoint) {
+        auto self(this->shared_from_this());
+        ++context_.active_connections;
+
+        socket_.async_connect(endpoint, [this, self](boost::system::error_code ec) {
+            if (ec) {
+                ++context_.stats.connect_errors;
+                finish();
+                return;
+            }
+            ++context_.stats.connected;
+            while (in_flight_.size() < context_.options.depth && send_next()) {}
+            do_read();
+        });
+    }
+
+private: // structs
+
+    enum class State { header, body, status_message, status_end };
+
+    struct Request {
+        size_t command;
+        clock_type::time_point sent;
+        bool first_byte;
+    };
+
+private: // methods
+
+    bool send_next() {
+        if (clock_type::now() >= context_.stop_time) {
+            return false;
+        }
+        auto command = context_.mix_distribution(random_);
+        // Daemon numbers non-empty command lines from 1
+        in_flight_[++last_request_id_] = Request{command, clock_type::now(), false};
+        outgoing_ += context_.options.mix[command].second;
+        outgoing_ += '\n';
+        do_write();
+        return true;
+    }
+
+    void do_write() {
+        if (writing_ || outgoing_.empty()) {
+            return;
+        }
+        writing_ = true;
+        auto self(this->shared_from_this());
+        auto data = std::make_shared<std::string>();
+        data->swap(outgoing_);
+
+        boost::asio::async_write(socket_, boost::asio::buffer(*data),
+            [this, self, data](boost::system::error_code ec, size_t) {
+                writing_ = false;
+                if (ec) {
+                    ++context_.stats.io_errors;
+                    close();
+                    return;
+                }
+                do_write();
+            });
+    }
+
+    void do_read() {
+        auto self(this->shared_from_this());
+
+        socket_.async_read_some(boost::asio::buffer(read_buffer_, read_buffer_length),
+            [this, self](boost::system::error_code ec, size_t length) {
+                if (ec) {
+                    if (!in_flight_.empty()) {
+                        ++context_.stats.io_errors;
+                    }
+                    finish();
+                    return;
+                }
+                context_.stats.bytes_received += length;
+                pending_.insert(pending_.end(), read_buffer_, read_buffer_ + length);
+                if (!parse(clock_type::now())) {
+                    ++context_.stats.io_errors;
+                    finish();
+                    return;
+                }
+                if (in_flight_.empty() && clock_type::now() >= context_.stop_time) {
+                    finish();
+                    return;
+                }
+                do_read();
+            });
+    }
+
+    // Returns false on protocol error
+    bool parse(clock_type::time_point now) {
+        size_t pos = 0;
+        while (pos < pending_.size()) {
+            if (state_ == State::body) {
+                auto skipped = std::min(body_left_, pending_.size() - pos);
+                body_left_ -= skipped;
+                pos += skipped;
+                if (!body_left_) {
+                    state_ = State::header;
+                }
+                continue;
+            }
+            if (state_ == State::status_end) {
+                // Status message is terminated by zero byte
+                if (pending_[pos] == '\0') {
+                    ++pos;
+                }
+                state_ = State::header;
+                continue;
+            }
+            auto end = std::find(pending_.begin() + pos, pending_.end(), '\n');
+            if (end == pending_.end()) {
+                break;
+            }
+            std::string line(pending_.begin() + pos, end);
+            pos = end - pending_.begin() + 1;
+
+            if (state_ == State::status_message) {
+                complete(status_id_, line, now);
+                state_ = State::status_end;
+                continue;
+            }
+            if (!parse_header(line, now)) {
+                return false;
+            }
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + pos);
+        return true;
+    }
+
+    bool parse_header(const std::string& line, clock_type::time_point now) {
+        size_t id = 0;
+        size_t length = 0;
+        if (sscanf(line.c_str(), "*** STDOUT %zu %zu ***", &id, &length) == 2
+            || sscanf(line.c_str(), "*** STDERR %zu %zu ***", &id, &length) == 2) {
+            first_byte(id, now);
+            body_left_ = length;
+            state_ = length ? State::body : State::header;
+            return true;
+        }
+        if (sscanf(line.c_str(), "*** STATUS %zu ***", &id) == 1) {
+            first_byte(id, now);
+            status_id_ = id;
+            state_ = State::status_message;
+            return true;
+        }
+        if (sscanf(line.c_str(), "*** USAGE %zu ", &id) == 1) {
+            // Resource usage precedes the status
+            return true;
+        }
+        return false;
+    }
+
+    void first_byte(size_t id, clock_type::time_point now) {
+        auto it = in_flight_.find(id);
+        if (it == in_flight_.end() || it->second.first_byte) {
+            return;
+        }
+        it->second.first_byte = true;
+        std::chrono::duration<double, std::micro> elapsed = now - it->second.sent;
+        context_.stats.commands[it->second.command].first_byte_us.push_back(elapsed.count());
+    }
+
+    void complete(size_t id, const std::string& message, clock_type::time_point now) {
+        auto it = in_flight_.find(id);
+        if (it == in_flight_.end()) {
+            return;
+        }
+        auto& stats = context_.stats.commands[it->second.command];
+        std::chrono::duration<double, std::micro> elapsed = now - it->second.sent;
+        stats.latency_us.push_back(elapsed.count());
+
+        if (message == "Execution is successful") {
+            ++stats.succeeded;
+        } else if (message == "Invalid command") {
+            ++stats.invalid;
+        } else {
+            ++stats.failed;
+        }
+        in_flight_.erase(it);
+        send_next();
+    }
+
+    void close() {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    void finish() {
+        close();
+        --context_.active_connections;
+    }
+
+private: // fields
+
+    LoadContext& context_;
+    Socket socket_;
+    std::mt19937 random_;
+
+    // Sent commands without status by request id
+    std::map<size_t, Request> in_flight_;
+    size_t last_request_id_;
+
+    std::string outgoing_;
+    bool writing_;
+
+    // Response parser state
+    std::vector<char> pending_;
+    State state_;
+    size_t body_left_;
+    size_t status_id_;
+
+    char read_buffer_[read_buffer_length];
+};
+
+/* Resource usage of the daemon read from procfs */
+class DaemonMonitor {
+public: // constructors
+
+    DaemonMonitor(boost::asio::io_service& io_service, pid_t pid)
+        : pid_(pid), timer_(io_service), start_cpu_(0), cpu_percent_(0),
+        rss_kb_(0), peak_rss_kb_(0), running_(false)
+    {}
+
+public: // methods
+
+    void start() {
+        if (!pid_) {
+            return;
+        }
+        start_cpu_ = cpu_seconds();
+        start_time_ = clock_type::now();
+        running_ = true;
+        sample();
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+        timer_.cancel();
+        std::chrono::duration<double> elapsed = clock_type::now() - start_time_;
+        cpu_percent_ = elapsed.count() > 0 ? (cpu_seconds() - start_cpu_) / elapsed.count() * 100 : 0;
+        rss_kb_ = status_kb("VmRSS:");
+    }
+
+    size_t rss_kb() const {
+        return pid_ ? status_kb("VmRSS:") : 0;
+    }
+
+    void report(std::ostream& out) const {
+        if (!pid_) {
+            out << "daemon:    not monitored, use -p <pid> or -d <command>" << std::endl;
+            return;
+        }
+        out << "daemon:    pid " << pid_
+            << ", cpu " << std::fixed << std::setprecision(1) << cpu_percent_ << "%"
+            << ", rss " << rss_kb_ / 1024 << " MB"
+            << ", peak rss " << peak_rss_kb_ / 1024 << " MB" << std::endl;
+    }
+
+private: // methods
+
+    void sample() {
+        peak_rss_kb_ = std::max(peak_rss_kb_, status_kb("VmRSS:"));
+        timer_.expires_from_now(sample_period);
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec && running_) {
+                sample();
+            }
+        });
+    }
+
+    // User and system time of the daemon itself, children are not included
+    double cpu_seconds() const {
+        std::ifstream in("/proc/" + std::to_string(pid_) + "/stat");
+        std::string stat((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        // Process name can contain spaces, fields are counted after it
+        auto name_end = stat.rfind(')');
+        if (name_end == std::string::npos) {
+            return 0;
+        }
+        std::istringstream fields(stat.substr(name_end + 2));
+        std::string field;
+        unsigned long long utime = 0;
+        unsigned long long stime = 0;
+        // utime and stime are fields 14 and 15, state is field 3
+        for (int i = 3; i < 14 && fields >> field; ++i) {}
+        fields >> utime >> stime;
+        return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+    }
+
+    size_t status_kb(const std::string& key) const {
+        std::ifstream in("/proc/" + std::to_string(pid_) + "/status");
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, key.size(), key) == 0) {
+                size_t kb = 0;
+                std::istringstream(line.substr(key.size())) >> kb;
+                return kb;
+            }
+        }
+        return 0;
+    }
+
+private: // fields
+
+    pid_t pid_;
+    boost::asio::deadline_timer timer_;
+    double start_cpu_;
+    clock_type::time_point start_time_;
+    double cpu_percent_;
+    size_t rss_kb_;
+    size_t peak_rss_kb_;
+    bool running_;
+};
+
+void usage() {
+    std::cout << "USAGE: load-bench [-t <tcp>] [-l <local>] [-q <depth>] [-s <seconds>] [-i <idle>]" << std::endl
+        << "    [-a <address>] [-m <weight>:<command> ...] [-p <pid> | -d <daemon command>]" << std::endl
+        << "  -t <tcp>          number of TCP connections, 500 by default" << std::endl
+        << "  -l <local>        number of local socket connections, 500 by default" << std::endl
+        << "  -q <depth>        pipelined commands in flight per connection, 4 by default" << std::endl
+        << "  -s <seconds>      duration of the run, 10 by default" << std::endl
+        << "  -i <idle>         number of idle TCP connections, 0 by default" << std::endl
+        << "  -a <address>      TCP address of the daemon, 127.0.0.1 by default" << std::endl
+        << "  -m <w>:<command>  adds command with weight 'w' to the mix" << std::endl
+        << "  -p <pid>          monitors RSS and CPU of running daemon" << std::endl
+        << "  -d <command>      launches daemon for the run and monitors it" << std::endl;
+}
+
+Options parse_options(int argc, char* argv[]) {
+    Options options;
+    int option;
+    while ((option = getopt(argc, argv, "t:l:q:s:i:a:m:p:d:h")) != -1) {
+        switch (option) {
+            case 't': options.tcp_connections = boost::lexical_cast<size_t>(optarg); break;
+            case 'l': options.local_connections = boost::lexical_cast<size_t>(optarg); break;
+            case 'q': options.depth = std::max<size_t>(1, boost::lexical_cast<size_t>(optarg)); break;
+            case 's': options.seconds = boost::lexical_cast<size_t>(optarg); break;
+            case 'i': options.idle_connections = boost::lexical_cast<size_t>(optarg); break;
+            case 'a': options.address = optarg; break;
+            case 'p': options.daemon_pid = boost::lexical_cast<pid_t>(optarg); break;
+            case 'd': options.daemon_command = optarg; break;
+            case 'm': {
+                std::string entry(optarg);
+                auto colon = entry.find(':');
+                if (colon == std::string::npos || colon + 1 == entry.size()) {
+                    throw std::invalid_argument("Mix entry must be <weight>:<command>");
+                }
+                options.mix.push_back(std::make_pair(
+                    boost::lexical_cast<size_t>(entry.substr(0, colon)), entry.substr(colon + 1)));
+                break;
+            }
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if (options.mix.empty()) {
+        options.mix = {{90, "echo hello"}, {5, "head -c 1048576 /dev/zero"}, {5, "sleep 1"}};
+    }
+    return options;
+}
+
+void raise_descriptor_limit() {
+    // Thousands of connections need more than default soft limit,
+    // launched daemon inherits raised limit too
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+pid_t launch_daemon(const std::string& command) {
+    std::istringstream stream(command);
+    std::vector<std::string> args;
+    std::string arg;
+    while (stream >> arg) {
+        args.push_back(arg);
+    }
+    ProcessSpawner spawner(ProcessSpawner::Backend::posix_spawn);
+    auto pid = spawner.spawn(args, STDOUT_FILENO, STDERR_FILENO);
+    if (pid < 0) {
+        throw std::runtime_error("Can't launch daemon");
+    }
+
+    // Daemon is ready when local socket accepts connections
+    boost::asio::io_service io_service;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        stream_protocol::socket socket(io_service);
+        boost::system::error_code ec;
+        socket.connect(stream_protocol::endpoint(settings::local_socket_address), ec);
+        if (!ec) {
+            return pid;
+        }
+        if (waitpid(pid, nullptr, WNOHANG) == pid) {
+            throw std::runtime_error("Daemon exited on start");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    kill(pid, SIGTERM);
+    throw std::runtime_error("Daemon does not accept connections");
+}
+
+/* Opens idle connections and reports daemon memory taken by each of them */
+void open_idle_connections(boost::asio::io_service& io_service, const tcp::endpoint& endpoint,
+    const DaemonMonitor& monitor, size_t count, std::vector<std::unique_ptr<tcp::socket>>& sockets) {
+
+    auto rss_before = monitor.rss_kb();
+    size_t opened = 0;
+    for (size_t i = 0; i < count; ++i) {
+        std::unique_ptr<tcp::socket> socket(new tcp::socket(io_service));
+        boost::system::error_code ec;
+        socket->connect(endpoint, ec);
+        if (ec) {
+            std::cout << "idle:      stopped at " << opened << " connections, " << ec.message() << std::endl;
+            break;
+        }
+        sockets.push_back(std::move(socket));
+        ++opened;
+    }
+    // Let the daemon accept backlog
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    auto rss_after = monitor.rss_kb();
+
+    std::cout << "idle:      " << opened << " connections";
+    if (opened && rss_before) {
+        std::cout << ", daemon rss +" << (rss_after - rss_before) / 1024 << " MB, "
+            << (rss_after - rss_before) * 1024 / opened << " bytes per connection";
+    }
+    std::cout << std::endl;
+}
+
+double percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void print_percentiles(const char* name, std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    auto mean = values.empty() ? 0 : std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    std::cout << std::setw(10) << name << std::fixed << std::setprecision(0)
+        << std::setw(12) << mean
+        << std::setw(12) << percentile(values, 0.5)
+        << std::setw(12) << percentile(values, 0.99)
+        << std::setw(12) << percentile(values, 0.999)
+        << std::setw(12) << (values.empty() ? 0 : values.back()) << std::endl;
+}
+
+void report(const Options& options, const LoadStats& stats, double elapsed,
+    const DaemonMonitor& monitor) {
+
+    std::vector<double> latency_us;
+    std::vector<double> first_byte_us;
+    size_t completed = 0;
+    size_t errors = 0;
+    for (auto& command : stats.commands) {
+        latency_us.insert(latency_us.end(), command.latency_us.begin(), command.latency_us.end());
+        first_byte_us.insert(first_byte_us.end(), command.first_byte_us.begin(), command.first_byte_us.end());
+        completed += command.succeeded + command.failed + command.invalid;
+        errors += command.failed + command.invalid;
+    }
+
+    std::cout << "connections: " << stats.connected << " of "
+        << options.tcp_connections + options.local_connections
+        << ", connect errors " << stats.connect_errors
+        << ", io errors " << stats.io_errors << std::endl
+        << "commands:  " << completed << " in " << std::setprecision(1) << std::fixed << elapsed << " s, "
+        << std::setprecision(0) << completed / elapsed << " commands/s, "
+        << std::setprecision(1) << stats.bytes_received / elapsed / (1 << 20) << " MB/s received, "
+        << errors << " not successful" << std::endl;
+    monitor.report(std::cout);
+
+    std::cout << std::endl << std::setw(10) << "all, us"
+        << std::setw(12) << "mean" << std::setw(12) << "p50" << std::setw(12) << "p99"
+        << std::setw(12) << "p999" << std::setw(12) << "max" << std::endl;
+    print_percentiles("latency", latency_us);
+    print_percentiles("ttfb", first_byte_us);
+
+    for (size_t i = 0; i < options.mix.size(); ++i) {
+        auto& command = stats.commands[i];
+        std::cout << std::endl << "'" << options.mix[i].second << "': "
+            << command.succeeded << " successful, " << command.failed << " failed, "
+            << command.invalid << " invalid" << std::endl;
+        print_percentiles("latency", command.latency_us);
+        print_percentiles("ttfb", command.first_byte_us);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        auto options = parse_options(argc, argv);
+        raise_descriptor_limit();
+
+        if (!options.daemon_command.empty()) {
+            options.daemon_pid = launch_daemon(options.daemon_command);
+        }
+
+        boost::asio::io_service io_service;
+        LoadStats stats(options.mix.size());
+        LoadContext context(io_service, options, stats);
+        DaemonMonitor monitor(io_service, options.daemon_pid);
+
+        tcp::endpoint tcp_endpoint(boost::asio::ip::address::from_string(options.address), settings::port);
+        std::vector<std::unique_ptr<tcp::socket>> idle_sockets;
+        if (options.idle_connections) {
+            open_idle_connections(io_service, tcp_endpoint, monitor, options.idle_connections, idle_sockets);
+        }
+
+        auto start = clock_type::now();
+        context.stop_time = start + std::chrono::seconds(options.seconds);
+
+        stream_protocol::endpoint local_endpoint(settings::local_socket_address);
+        for (size_t i = 0; i < options.tcp_connections; ++i) {
+            std::make_shared<Connection<tcp::socket>>(context, i)->start(tcp_endpoint);
+        }
+        for (size_t i = 0; i < options.local_connections; ++i) {
+            std::make_shared<Connection<stream_protocol::socket>>(context, options.tcp_connections + i)
+                ->start(local_endpoint);
+        }
+        monitor.start();
+
+        // Run until every connection is done or in-flight commands hang
+        boost::asio::deadline_timer watchdog(io_service);
+        std::function<void(boost::system::error_code)> check;
+        check = [&](boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+            if (!context.active_connections || clock_type::now() > context.stop_time + drain_time) {
+                monitor.stop();
+                io_service.stop();
+                return;
+            }
+            watchdog.expires_from_now(sample_period);
+            watchdog.async_wait(check);
+        };
+        watchdog.expires_from_now(sample_period);
+        watchdog.async_wait(check);
+        io_service.run();
+
+        std::chrono::duration<double> elapsed = clock_type::now() - start;
+        report(options, stats, elapsed.count(), monitor);
+
+        if (!options.daemon_command.empty()) {
+            kill(options.daemon_pid, SIGTERM);
+            waitpid(options.daemon_pid, nullptr, 0);
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Load benchmark failed. " << e.what() << std::endl;
+    }
+    return 1;
+}
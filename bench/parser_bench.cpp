@@ -0,0 +1,95 @@
+/*
+    Command parser benchmark.
+    Feeds pipelined commands in session sized chunks and measures
+    parsed commands per second for CommandParser and for the previous
+    substr/erase parser (fixed to drain every command of a chunk).
+
+    USAGE: parser-bench [input_kb ...]
+*/
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/CommandParser.h"
+#include "../src/settings.h"
+
+class LegacyParser {
+public:
+    template <typename Handler>
+    void parse(const char* data, size_t length, Handler handler) {
+        data_.append(data, length);
+        size_t pos;
+        while ((pos = data_.find_first_of('\n')) != std::string::npos) {
+            auto cmd = data_.substr(0, pos);
+            boost::algorithm::trim(cmd);
+            data_.erase(0, pos + 1);
+            if (!cmd.empty()) {
+                handler(cmd);
+            }
+        }
+    }
+
+private:
+    std::string data_;
+};
+
+std::string make_input(size_t size) {
+    static const char* commands[] = {"ls -la /tmp\n", "pwd\n", "  uptime  \n", "cat /etc/hostname\n", "\n"};
+    std::string input;
+    for (size_t i = 0; input.size() < size; ++i) {
+        input += commands[i % 5];
+    }
+    return input;
+}
+
+template <typename Parser>
+double commands_per_second(const std::string& input, size_t min_commands) {
+    const size_t chunk = settings::session_buffer_length;
+    size_t commands = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    while (commands < min_commands) {
+        Parser parser;
+        for (size_t pos = 0; pos < input.size(); pos += chunk) {
+            auto length = std::min(chunk, input.size() - pos);
+            parser.parse(input.data() + pos, length, [&commands](const std::string& cmd) {
+                commands += !cmd.empty();
+            });
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return commands / elapsed.count();
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes_kb;
+    for (int i = 1; i < argc; ++i) {
+        sizes_kb.push_back(boost::lexical_cast<size_t>(argv[i]));
+    }
+    if (sizes_kb.empty()) {
+        sizes_kb = {1, 16, 128, 1024};
+    }
+
+    std::cout << std::setw(10) << "input KB"
+        << std::setw(18) << "legacy cmd/s"
+        << std::setw(18) << "parser cmd/s"
+        << std::setw(10) << "speedup" << std::endl;
+
+    for (auto size_kb : sizes_kb) {
+        auto input = make_input(size_kb << 10);
+        auto legacy_rate = commands_per_second<LegacyParser>(input, 2000000);
+        auto parser_rate = commands_per_second<CommandParser>(input, 2000000);
+
+        std::cout << std::setw(10) << size_kb
+            << std::setw(18) << std::fixed << std::setprecision(0) << legacy_rate
+            << std::setw(18) << parser_rate
+            << std::setw(9) << std::setprecision(2) << parser_rate / legacy_rate << "x"
+            << std::endl;
+    }
+    return 0;
+}
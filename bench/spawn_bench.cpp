@@ -0,0 +1,101 @@
+/*
+    Spawn throughput benchmark.
+    Compares fork() + execv() against posix_spawn() for different
+    parent heap sizes. Parent runs several idle threads like the daemon does.
+
+    USAGE: spawn-bench [spawns_per_run] [heap_mb ...]
+*/
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/ProcessSpawner.h"
+#include "../src/settings.h"
+
+double spawns_per_second(const ProcessSpawner& spawner, size_t spawns, int null_fd) {
+    std::vector<std::string> args = {"/bin/true"};
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < spawns; ++i) {
+        auto pid = spawner.spawn(args, null_fd, null_fd);
+        if (pid < 0) {
+            throw std::runtime_error("spawn failed");
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return spawns / elapsed.count();
+}
+
+int main(int argc, char* argv[]) {
+    size_t spawns = argc > 1 ? boost::lexical_cast<size_t>(argv[1]) : 2000;
+
+    std::vector<size_t> heap_sizes_mb;
+    for (int i = 2; i < argc; ++i) {
+        heap_sizes_mb.push_back(boost::lexical_cast<size_t>(argv[i]));
+    }
+    if (heap_sizes_mb.empty()) {
+        heap_sizes_mb = {10, 100, 500, 1024, 2048};
+    }
+
+    // Idle threads, as in the daemon thread pool
+    boost::mutex mutex;
+    boost::condition_variable stop_cv;
+    bool stop = false;
+    std::vector<std::shared_ptr<boost::thread>> threads;
+    for (size_t i = 0; i < settings::server_thread_pool_size; ++i) {
+        threads.emplace_back(new boost::thread([&]() {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!stop) stop_cv.wait(lock);
+        }));
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    ProcessSpawner fork_spawner(ProcessSpawner::Backend::fork_exec);
+    ProcessSpawner posix_spawner(ProcessSpawner::Backend::posix_spawn);
+
+    std::cout << std::setw(10) << "heap MB"
+        << std::setw(16) << "fork+exec/s"
+        << std::setw(16) << "posix_spawn/s"
+        << std::setw(10) << "speedup" << std::endl;
+
+    for (auto heap_mb : heap_sizes_mb) {
+        // Touch every page so it is really mapped into the parent
+        std::vector<char> heap(heap_mb << 20);
+        for (size_t i = 0; i < heap.size(); i += 4096) {
+            heap[i] = static_cast<char>(i);
+        }
+
+        auto fork_rate = spawns_per_second(fork_spawner, spawns, null_fd);
+        auto spawn_rate = spawns_per_second(posix_spawner, spawns, null_fd);
+
+        std::cout << std::setw(10) << heap_mb
+            << std::setw(16) << std::fixed << std::setprecision(0) << fork_rate
+            << std::setw(16) << spawn_rate
+            << std::setw(9) << std::setprecision(2) << spawn_rate / fork_rate << "x"
+            << std::endl;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stop = true;
+    }
+    stop_cv.notify_all();
+    for (auto& thread : threads) {
+        thread->join();
+    }
+    close(null_fd);
+    return 0;
+}
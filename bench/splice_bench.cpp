@@ -0,0 +1,128 @@
+/*
+    Pipe to socket forwarding benchmark.
+    Moves data from a pipe filled by a writer thread to a unix socket
+    drained by a reader thread, the same way the daemon forwards child output:
+    - copy: read() of settings::process_buffer_length bytes, header and
+      chunk copied to a new buffer, write() to the socket;
+    - splice: header write() and splice() of all buffered pipe bytes.
+
+    USAGE: splice-bench [megabytes]
+*/
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/settings.h"
+
+typedef std::vector<char> buffer_type;
+
+void write_all(int fd, const char* data, size_t length) {
+    while (length) {
+        auto written = write(fd, data, length);
+        if (written <= 0) {
+            throw std::runtime_error("write failed");
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+std::string chunk_header(size_t length) {
+    return "*** STDOUT 1 " + std::to_string(length) + " ***\n";
+}
+
+void forward_copy(int pipe_fd, int socket_fd) {
+    char buf[settings::process_buffer_length];
+    ssize_t length;
+    while ((length = read(pipe_fd, buf, sizeof(buf))) > 0) {
+        auto header = chunk_header(length);
+        auto chunk = std::make_shared<buffer_type>(header.begin(), header.end());
+        chunk->insert(chunk->end(), buf, buf + length);
+        write_all(socket_fd, chunk->data(), chunk->size());
+    }
+}
+
+void forward_splice(int pipe_fd, int socket_fd) {
+    while (true) {
+        int available = 0;
+        ioctl(pipe_fd, FIONREAD, &available);
+        if (available == 0) {
+            // Wait for data or EOF
+            char c;
+            auto length = read(pipe_fd, &c, 1);
+            if (length <= 0) {
+                return;
+            }
+            auto header = chunk_header(1);
+            write_all(socket_fd, header.data(), header.size());
+            write_all(socket_fd, &c, 1);
+            continue;
+        }
+        auto header = chunk_header(available);
+        write_all(socket_fd, header.data(), header.size());
+        while (available) {
+            auto moved = splice(pipe_fd, nullptr, socket_fd, nullptr, available, SPLICE_F_MOVE);
+            if (moved <= 0) {
+                throw std::runtime_error("splice failed");
+            }
+            available -= moved;
+        }
+    }
+}
+
+double forward_megabytes_per_second(size_t megabytes, void (*forward)(int, int)) {
+    int pipe_fds[2];
+    int socket_fds[2];
+    if (pipe(pipe_fds) || socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds)) {
+        throw std::runtime_error("pipe failed");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    boost::thread writer([&]() {
+        std::vector<char> data(1 << 16, 'x');
+        for (size_t left = megabytes << 20; left; left -= std::min(left, data.size())) {
+            write_all(pipe_fds[1], data.data(), std::min(left, data.size()));
+        }
+        close(pipe_fds[1]);
+    });
+    boost::thread reader([&]() {
+        std::vector<char> data(1 << 16);
+        while (read(socket_fds[1], data.data(), data.size()) > 0) {}
+    });
+
+    forward(pipe_fds[0], socket_fds[0]);
+    close(socket_fds[0]);
+    writer.join();
+    reader.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    close(pipe_fds[0]);
+    close(socket_fds[1]);
+    return megabytes / elapsed.count();
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? boost::lexical_cast<size_t>(argv[1]) : 1024;
+
+    auto copy_rate = forward_megabytes_per_second(megabytes, forward_copy);
+    auto splice_rate = forward_megabytes_per_second(megabytes, forward_splice);
+
+    std::cout << std::fixed << std::setprecision(0)
+        << "copy:   " << copy_rate << " MB/s" << std::endl
+        << "splice: " << splice_rate << " MB/s" << std::endl
+        << std::setprecision(2)
+        << "speedup: " << splice_rate / copy_rate << "x" << std::endl;
+    return 0;
+}
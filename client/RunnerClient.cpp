@@ -0,0 +1,398 @@
+#include <algorithm>
+
+#include "../src/FrameParser.h"
+#include "RunnerClient.h"
+
+namespace {
+
+const size_t read_buffer_length = 16384;
+
+void put_u32(std::string& data, uint32_t value) {
+    data += static_cast<char>(value >> 24);
+    data += static_cast<char>(value >> 16);
+    data += static_cast<char>(value >> 8);
+    data += static_cast<char>(value);
+}
+
+uint32_t get_u32(const char* data) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+/*
+    Parses batch item payload:
+        <u32 index> <u64 wall us> <u8 flags> <u32 count> <count statuses>
+        <u32 length> <stdout> <u32 length> <stderr>
+    Refused command has no statuses and its error in place of stderr.
+*/
+bool parse_batch_item(const char* payload, size_t length, RunnerClient::Result& item) {
+    const size_t fixed_length = 4 + 8 + 1 + 4;
+    if (length < fixed_length) {
+        return false;
+    }
+    item.index = get_u32(payload);
+    item.wall_us = (uint64_t(get_u32(payload + 4)) << 32) | get_u32(payload + 8);
+    item.truncation = static_cast<unsigned char>(payload[12]);
+    auto count = get_u32(payload + 13);
+    size_t pos = fixed_length;
+    if (count > (length - pos) / 4) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i, pos += 4) {
+        item.statuses.push_back(static_cast<int>(get_u32(payload + pos)));
+    }
+    item.launched = count != 0;
+    for (auto data : {&item.stdout_data, &item.stderr_data}) {
+        if (length - pos < 4 || get_u32(payload + pos) > length - pos - 4) {
+            return false;
+        }
+        data->assign(payload + pos + 4, get_u32(payload + pos));
+        pos += 4 + data->size();
+    }
+    if (!item.launched) {
+        item.error.swap(item.stderr_data);
+    }
+    return pos == length;
+}
+
+/*
+    Parses usage payload of eight u64 values: wall us, user us, system us, max rss kb,
+    voluntary and involuntary context switches, input and output blocks.
+*/
+bool parse_usage(const char* payload, size_t length, RunnerClient::Result& result) {
+    if (length != 8 * 8) {
+        return false;
+    }
+    auto& usage = result.usage;
+    uint64_t* fields[] = {&result.wall_us, &usage.user_us, &usage.system_us, &usage.max_rss_kb,
+        &usage.voluntary_switches, &usage.involuntary_switches, &usage.input_blocks, &usage.output_blocks};
+    for (auto field : fields) {
+        *field = (uint64_t(get_u32(payload)) << 32) | get_u32(payload + 4);
+        payload += 8;
+    }
+    return true;
+}
+
+}
+
+/*
+    One pooled connection. All its state is touched only from the client strand.
+    Requests are written as soon as they are assigned, even while connecting.
+*/
+class RunnerClient::Connection : public std::enable_shared_from_this<RunnerClient::Connection> {
+public: // constructors
+
+    Connection(RunnerClient& owner)
+        : owner_(owner),
+        socket_(owner.io_service_),
+        connected_(false),
+        closed_(false),
+        last_request_id_(0),
+        // Handshake goes out with the first requests
+        outgoing_(FrameParser::magic, sizeof(FrameParser::magic)),
+        writing_(false),
+        handshake_done_(false)
+    {}
+
+public: // methods
+
+    void start() {
+        auto self(shared_from_this());
+        socket_.async_connect(owner_.endpoint_, owner_.strand_.wrap([this, self](boost::system::error_code ec) {
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                fail(ec);
+                return;
+            }
+            connected_ = true;
+            do_write();
+            do_read();
+        }));
+    }
+
+    void send(const request_ptr& request) {
+        // Daemon numbers requests of a connection from 1
+        in_flight_[++last_request_id_] = request;
+        outgoing_ += request->frame;
+        do_write();
+    }
+
+    size_t in_flight() const {
+        return in_flight_.size();
+    }
+
+    void close() {
+        fail(boost::asio::error::operation_aborted);
+    }
+
+private: // methods
+
+    void do_write() {
+        if (!connected_ || closed_ || writing_ || outgoing_.empty()) {
+            return;
+        }
+        writing_ = true;
+        auto self(shared_from_this());
+        auto data = std::make_shared<std::string>();
+        data->swap(outgoing_);
+
+        boost::asio::async_write(socket_, boost::asio::buffer(*data),
+            owner_.strand_.wrap([this, self, data](boost::system::error_code ec, size_t) {
+                writing_ = false;
+                if (closed_) {
+                    return;
+                }
+                if (ec) {
+                    fail(ec);
+                    return;
+                }
+                do_write();
+            }));
+    }
+
+    void do_read() {
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(read_buffer_, read_buffer_length),
+            owner_.strand_.wrap([this, self](boost::system::error_code ec, size_t length) {
+                if (closed_) {
+                    return;
+                }
+                if (ec) {
+                    // Daemon closes idle connections, which is not an error without requests
+                    fail(ec);
+                    return;
+                }
+                pending_.insert(pending_.end(), read_buffer_, read_buffer_ + length);
+                if (!parse()) {
+                    fail(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+                    return;
+                }
+                do_read();
+            }));
+    }
+
+    // Returns false on protocol error
+    bool parse() {
+        size_t pos = 0;
+        if (!handshake_done_) {
+            if (pending_.size() < sizeof(FrameParser::magic)) {
+                return true;
+            }
+            if (!std::equal(FrameParser::magic, FrameParser::magic + sizeof(FrameParser::magic), pending_.begin())) {
+                return false;
+            }
+            pos = sizeof(FrameParser::magic);
+            handshake_done_ = true;
+        }
+        while (pending_.size() - pos >= FrameParser::header_length) {
+            const char* frame = pending_.data() + pos;
+            auto length = get_u32(frame + 5);
+            if (pending_.size() - pos - FrameParser::header_length < length) {
+                // Wait for the rest of payload
+                break;
+            }
+            if (!handle_frame(static_cast<FrameParser::Type>(frame[0]), get_u32(frame + 1),
+                frame + FrameParser::header_length, length)) {
+                return false;
+            }
+            pos += FrameParser::header_length + length;
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + pos);
+        return true;
+    }
+
+    bool handle_frame(FrameParser::Type type, uint32_t id, const char* payload, size_t length) {
+        if (!id) {
+            // Daemon could not parse our frames
+            return false;
+        }
+        auto it = in_flight_.find(id);
+        if (it == in_flight_.end()) {
+            return true;
+        }
+        auto& request = *it->second;
+        switch (type) {
+            case FrameParser::Type::stdout_chunk:
+            case FrameParser::Type::stderr_chunk: {
+                auto stream = type == FrameParser::Type::stdout_chunk ? Stream::output : Stream::error;
+                if (request.on_chunk) {
+                    request.on_chunk(stream, payload, length);
+                } else {
+                    auto& data = stream == Stream::output ? request.result.stdout_data : request.result.stderr_data;
+                    data.append(payload, length);
+                }
+                return true;
+            }
+            case FrameParser::Type::exit:
+                // One status per stage, then optional truncation flags
+                request.result.launched = true;
+                for (size_t pos = 0; pos + 4 <= length; pos += 4) {
+                    request.result.statuses.push_back(static_cast<int>(get_u32(payload + pos)));
+                }
+                if (length % 4) {
+                    request.result.truncation = static_cast<unsigned char>(payload[length - 1]);
+                }
+                complete(it);
+                return true;
+            case FrameParser::Type::error:
+                request.result.error.assign(payload, length);
+                complete(it);
+                return true;
+            case FrameParser::Type::batch_item:
+                request.result.items.emplace_back();
+                return parse_batch_item(payload, length, request.result.items.back());
+            case FrameParser::Type::usage:
+                return parse_usage(payload, length, request.result);
+            default:
+                return false;
+        }
+    }
+
+    void complete(std::map<uint32_t, request_ptr>::iterator it) {
+        auto request = it->second;
+        in_flight_.erase(it);
+        request->on_result(boost::system::error_code(), request->result);
+        owner_.dispatch();
+    }
+
+    void fail(boost::system::error_code ec) {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+
+        auto self(shared_from_this());
+        owner_.handle_closed(self);
+        std::map<uint32_t, request_ptr> requests;
+        requests.swap(in_flight_);
+        for (auto& entry : requests) {
+            entry.second->on_result(ec, entry.second->result);
+        }
+        owner_.dispatch();
+    }
+
+private: // fields
+
+    RunnerClient& owner_;
+    boost::asio::generic::stream_protocol::socket socket_;
+    bool connected_;
+    bool closed_;
+
+    // Sent requests without result by request id
+    std::map<uint32_t, request_ptr> in_flight_;
+    uint32_t last_request_id_;
+
+    std::string outgoing_;
+    bool writing_;
+
+    std::vector<char> pending_;
+    bool handshake_done_;
+    char read_buffer_[read_buffer_length];
+};
+
+bool RunnerClient::Result::successful() const {
+    if (!launched || statuses.empty()) {
+        return false;
+    }
+    if (items.empty()) {
+        // Statuses of pipeline stages
+        return pipeline_status(statuses) == 0;
+    }
+    return std::all_of(statuses.begin(), statuses.end(), [](int status) { return status == 0; });
+}
+
+RunnerClient::RunnerClient(boost::asio::io_service& io_service, const endpoint_type& endpoint,
+    size_t connections, size_t depth)
+
+    : io_service_(io_service),
+    strand_(io_service),
+    endpoint_(endpoint),
+    max_connections_(std::max<size_t>(connections, 1)),
+    depth_(std::max<size_t>(depth, 1))
+{}
+
+void RunnerClient::run(const std::vector<std::string>& args, result_handler on_result) {
+    submit(args, chunk_handler(), on_result);
+}
+
+void RunnerClient::stream(const std::vector<std::string>& args, chunk_handler on_chunk, result_handler on_result) {
+    submit(args, on_chunk, on_result);
+}
+
+std::future<RunnerClient::Result> RunnerClient::run(const std::vector<std::string>& args) {
+    auto promise = std::make_shared<std::promise<Result>>();
+    run(args, [promise](boost::system::error_code ec, Result& result) {
+        if (ec) {
+            promise->set_exception(std::make_exception_ptr(boost::system::system_error(ec)));
+            return;
+        }
+        promise->set_value(std::move(result));
+    });
+    return promise->get_future();
+}
+
+void RunnerClient::close() {
+    strand_.post([this]() {
+        std::vector<connection_ptr> connections;
+        connections.swap(connections_);
+        std::deque<request_ptr> queue;
+        queue.swap(queue_);
+
+        for (auto& connection : connections) {
+            connection->close();
+        }
+        for (auto& request : queue) {
+            request->on_result(boost::asio::error::operation_aborted, request->result);
+        }
+    });
+}
+
+void RunnerClient::submit(const std::vector<std::string>& args, chunk_handler on_chunk, result_handler on_result) {
+    auto request = std::make_shared<Request>();
+    request->on_chunk = on_chunk;
+    request->on_result = on_result;
+
+    // Frame is built by the caller thread
+    std::string payload;
+    put_u32(payload, args.size());
+    for (auto& arg : args) {
+        put_u32(payload, arg.size());
+        payload += arg;
+    }
+    request->frame = FrameParser::header(FrameParser::Type::request, 0, payload.size()) + payload;
+
+    strand_.post([this, request]() {
+        queue_.push_back(request);
+        dispatch();
+    });
+}
+
+void RunnerClient::dispatch() {
+    while (!queue_.empty()) {
+        // Least loaded connection takes the request, another one is opened while all are busy
+        connection_ptr connection;
+        for (auto& candidate : connections_) {
+            if (!connection || candidate->in_flight() < connection->in_flight()) {
+                connection = candidate;
+            }
+        }
+        if ((!connection || connection->in_flight()) && connections_.size() < max_connections_) {
+            connection = std::make_shared<Connection>(*this);
+            connections_.push_back(connection);
+            connection->start();
+        } else if (connection->in_flight() >= depth_) {
+            break;
+        }
+        auto request = queue_.front();
+        queue_.pop_front();
+        connection->send(request);
+    }
+}
+
+void RunnerClient::handle_closed(const connection_ptr& connection) {
+    connections_.erase(std::remove(connections_.begin(), connections_.end(), connection), connections_.end());
+}
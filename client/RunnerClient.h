@@ -0,0 +1,138 @@
+#ifndef RUNNER_CLIENT_H
+#define RUNNER_CLIENT_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <future>
+#include <functional>
+#include <cstdint>
+
+#include <boost/asio.hpp>
+
+#include "../src/result_types.h"
+
+/*
+    Client of the daemon binary protocol over TCP or the local socket.
+    Keeps a pool of up to 'connections' persistent connections and pipelines
+    up to 'depth' requests on each of them, further requests wait in the client.
+    Responses are matched to requests by id, which both sides count from 1
+    on every connection, so output of pipelined requests may interleave freely.
+    Output is either collected into the result or streamed to the caller.
+    Methods can be called from any thread, handlers are called from threads
+    running the io_service through the client strand, so they must not block.
+    Client must outlive its connections: call 'close' and let the io_service
+    finish before destroying it.
+*/
+class RunnerClient {
+public: // structs
+
+    // Accepts both tcp and local stream endpoints
+    typedef boost::asio::generic::stream_protocol::endpoint endpoint_type;
+
+    enum class Stream { output, error };
+
+    struct Result {
+        // False if daemon refused request, 'error' tells why
+        bool launched;
+        std::string error;
+        // Waitpid status of every pipeline stage
+        std::vector<int> statuses;
+        // TruncationFlag bits
+        unsigned truncation;
+        // Empty if output was streamed
+        std::string stdout_data;
+        std::string stderr_data;
+        // Results of batch commands in arrival order, 'statuses' of the batch
+        // has status of every command, -1 if it was refused
+        std::vector<Result> items;
+        // Position of batch command in the batch and its runtime,
+        // runtime of a plain command is reported with its usage
+        size_t index;
+        uint64_t wall_us;
+        // Zero if daemon did not run the command itself
+        ResourceUsage usage;
+
+        Result() : launched(false), truncation(0), index(0), wall_us(0) {}
+
+        /* Launched and pipeline status is 0, or every command of batch exited with 0 */
+        bool successful() const;
+    };
+
+    /* Error is set if connection failed before the result was received */
+    typedef std::function<void(boost::system::error_code ec, Result& result)> result_handler;
+    typedef std::function<void(Stream stream, const char* data, size_t length)> chunk_handler;
+
+public: // constructors
+
+    RunnerClient(boost::asio::io_service& io_service, const endpoint_type& endpoint,
+        size_t connections, size_t depth);
+
+    /* Noncopyable */
+    RunnerClient(const RunnerClient&) = delete;
+    RunnerClient& operator = (const RunnerClient&) = delete;
+
+public: // methods
+
+    /*
+        Runs 'args' (args[0] is the configured command, a "|" argument separates
+        pipeline stages) and calls 'on_result' with collected output.
+        Batch request 'batch <command> ; <command> ...' collects results of its commands.
+    */
+    void run(const std::vector<std::string>& args, result_handler on_result);
+
+    /*
+        Like 'run', but output is passed to 'on_chunk' as it arrives
+        and is not kept in the result.
+    */
+    void stream(const std::vector<std::string>& args, chunk_handler on_chunk, result_handler on_result);
+
+    /*
+        Like 'run' for callers outside of the io_service threads.
+        Failed connection is reported as boost::system::system_error.
+    */
+    std::future<Result> run(const std::vector<std::string>& args);
+
+    /*
+        Closes all connections, sent and waiting requests fail with operation_aborted.
+    */
+    void close();
+
+private: // structs
+
+    class Connection;
+    typedef std::shared_ptr<Connection> connection_ptr;
+
+    struct Request {
+        // Serialized request frame
+        std::string frame;
+        chunk_handler on_chunk;
+        result_handler on_result;
+        Result result;
+    };
+    typedef std::shared_ptr<Request> request_ptr;
+
+private: // methods
+
+    void submit(const std::vector<std::string>& args, chunk_handler on_chunk, result_handler on_result);
+
+    // Must be called from the strand
+    void dispatch();
+    void handle_closed(const connection_ptr& connection);
+
+private: // fields
+
+    boost::asio::io_service& io_service_;
+    boost::asio::io_service::strand strand_;
+    endpoint_type endpoint_;
+    size_t max_connections_;
+    size_t depth_;
+
+    std::vector<connection_ptr> connections_;
+    // Requests waiting for a connection with free pipelining slot
+    std::deque<request_ptr> queue_;
+};
+
+#endif // RUNNER_CLIENT_H
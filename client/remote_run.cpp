@@ -0,0 +1,276 @@
+/*
+    Command line client of the daemon.
+    Runs one command and streams its output, or runs every line of a file
+    as a command through a pool of pipelined connections and prints results
+    in file order, each after a '==> <command> <==' line.
+    Results of batch commands follow '--> <index> (<runtime>) <--' lines.
+    Exit code is the exit code of the command (128 + signal if killed),
+    in file mode 0 if every command succeeded and 1 otherwise.
+    With -v resource usage of the command is printed to stderr.
+
+    USAGE: remote-run [-a <address>] [-p <port>] [-u <socket>] [-c <connections>] [-q <depth>] [-v]
+        (-f <file> | <command> [<args> ...])
+*/
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "../src/settings.h"
+#include "../src/result_types.h"
+#include "RunnerClient.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+const int failure_exit_code = 255;
+
+struct Options {
+    // Local socket is used if empty
+    std::string address;
+    size_t port;
+    std::string socket_path;
+    size_t connections;
+    size_t depth;
+    std::string file;
+    bool verbose;
+    std::vector<std::string> args;
+
+    Options()
+        : port(settings::port), socket_path(settings::local_socket_address),
+        connections(4), depth(settings::session_max_running_tasks), verbose(false)
+    {}
+};
+
+void usage() {
+    std::cout << "USAGE: remote-run [-a <address>] [-p <port>] [-u <socket>] [-c <connections>] [-q <depth>] [-v]" << std::endl
+        << "    (-f <file> | <command> [<args> ...])" << std::endl
+        << "  -a <address>      TCP address of the daemon, local socket is used by default" << std::endl
+        << "  -p <port>         TCP port of the daemon, " << settings::port << " by default" << std::endl
+        << "  -u <socket>       local socket of the daemon, " << settings::local_socket_address << " by default" << std::endl
+        << "  -c <connections>  maximal number of connections, 4 by default" << std::endl
+        << "  -q <depth>        pipelined commands per connection, "
+        << settings::session_max_running_tasks << " by default" << std::endl
+        << "  -v                prints resource usage of the command" << std::endl
+        << "  -f <file>         runs every line of file as a command, '-' reads stdin" << std::endl;
+}
+
+Options parse_options(int argc, char* argv[]) {
+    Options options;
+    int option;
+    // Options end at the command, its own options are passed as is
+    while ((option = getopt(argc, argv, "+a:p:u:c:q:f:vh")) != -1) {
+        switch (option) {
+            case 'a': options.address = optarg; break;
+            case 'p': options.port = boost::lexical_cast<size_t>(optarg); break;
+            case 'u': options.socket_path = optarg; break;
+            case 'c': options.connections = boost::lexical_cast<size_t>(optarg); break;
+            case 'q': options.depth = boost::lexical_cast<size_t>(optarg); break;
+            case 'f': options.file = optarg; break;
+            case 'v': options.verbose = true; break;
+            default:
+                usage();
+                exit(failure_exit_code);
+        }
+    }
+    options.args.assign(argv + optind, argv + argc);
+    if (options.file.empty() == options.args.empty()) {
+        usage();
+        exit(failure_exit_code);
+    }
+    return options;
+}
+
+RunnerClient::endpoint_type make_endpoint(const Options& options) {
+    if (options.address.empty()) {
+        return stream_protocol::endpoint(options.socket_path);
+    }
+    return tcp::endpoint(boost::asio::ip::address::from_string(options.address), options.port);
+}
+
+/* Describes how request ended, empty if it was successful */
+std::string describe(boost::system::error_code ec, const RunnerClient::Result& result) {
+    if (ec) {
+        return "Connection failed. " + ec.message();
+    }
+    if (!result.launched) {
+        return result.error;
+    }
+    std::string description;
+    if (!result.successful()) {
+        description = result.statuses.size() > 1 ? "Exit codes: " : "Exit code: ";
+        for (size_t i = 0; i < result.statuses.size(); ++i) {
+            // Refused batch command has no status
+            auto status = result.statuses[i];
+            description += (i ? ", " : "") + (status == -1 ? std::string("-") : describe_exit(status));
+        }
+    }
+    if (result.truncation & killed_by_output_limit) {
+        description += description.empty() ? "Output limit exceeded" : ", output limit exceeded";
+    } else if (result.truncation) {
+        description += description.empty() ? "Output is truncated" : ", output is truncated";
+    }
+    return description;
+}
+
+/* Prints results of batch commands, each after a '--> <index> (<runtime>) <--' line */
+void print_items(const RunnerClient::Result& result) {
+    for (auto& item : result.items) {
+        auto description = describe(boost::system::error_code(), item);
+        std::cout << "--> " << item.index << " (" << item.wall_us << " us"
+            << (description.empty() ? "" : ", ") << description << ") <--" << std::endl
+            << item.stdout_data;
+        std::cerr << item.stderr_data;
+    }
+}
+
+/* Prints resources used by children of the command */
+void print_usage(const RunnerClient::Result& result) {
+    auto& usage = result.usage;
+    std::cerr << "remote-run: " << result.wall_us << " us wall, "
+        << usage.user_us << " us user, " << usage.system_us << " us system, "
+        << usage.max_rss_kb << " KB max RSS, "
+        << usage.voluntary_switches << "/" << usage.involuntary_switches << " context switches, "
+        << usage.input_blocks << "/" << usage.output_blocks << " blocks in/out" << std::endl;
+}
+
+// Exit code of the command, or of the first failed command of a batch
+int exit_code(boost::system::error_code ec, const RunnerClient::Result& result) {
+    if (ec || !result.launched) {
+        return failure_exit_code;
+    }
+    // Batch fails with its first failed command, pipeline with its status
+    auto statuses = result.items.empty() ? std::vector<int>{pipeline_status(result.statuses)} : result.statuses;
+    for (auto status : statuses) {
+        if (status == -1) {
+            // Refused command of a batch
+            return failure_exit_code;
+        }
+        if (WIFSIGNALED(status)) {
+            return 128 + WTERMSIG(status);
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status)) {
+            return WEXITSTATUS(status);
+        }
+    }
+    return 0;
+}
+
+int run_command(boost::asio::io_service& io_service, RunnerClient& client,
+    const std::vector<std::string>& args, bool verbose) {
+    int code = failure_exit_code;
+    client.stream(args,
+        [](RunnerClient::Stream stream, const char* data, size_t length) {
+            auto& out = stream == RunnerClient::Stream::output ? std::cout : std::cerr;
+            out.write(data, length);
+        },
+        [&](boost::system::error_code ec, RunnerClient::Result& result) {
+            print_items(result);
+            auto description = describe(ec, result);
+            if (!description.empty()) {
+                std::cerr << "remote-run: " << description << std::endl;
+            }
+            if (verbose && !ec && result.launched) {
+                print_usage(result);
+            }
+            code = exit_code(ec, result);
+            client.close();
+        });
+    io_service.run();
+    return code;
+}
+
+/* Commands of the file run concurrently, results are printed in file order */
+int run_file(boost::asio::io_service& io_service, RunnerClient& client, const std::string& file) {
+    std::ifstream file_stream;
+    if (file != "-") {
+        file_stream.open(file);
+        if (!file_stream) {
+            std::cerr << "remote-run: can't open " << file << std::endl;
+            return failure_exit_code;
+        }
+    }
+    std::istream& in = file == "-" ? std::cin : file_stream;
+
+    std::vector<std::string> lines;
+    std::vector<std::vector<std::string>> commands;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
+        if (!args.empty()) {
+            lines.push_back(line);
+            commands.push_back(args);
+        }
+    }
+    if (commands.empty()) {
+        return 0;
+    }
+
+    struct Outcome {
+        bool done;
+        boost::system::error_code ec;
+        RunnerClient::Result result;
+    };
+    std::vector<Outcome> outcomes(commands.size(), Outcome{false, boost::system::error_code(), RunnerClient::Result()});
+    size_t next_printed = 0;
+    bool failed = false;
+
+    // Handlers run on the single io_service thread
+    auto print_ready = [&]() {
+        for (; next_printed < outcomes.size() && outcomes[next_printed].done; ++next_printed) {
+            auto& outcome = outcomes[next_printed];
+            auto description = describe(outcome.ec, outcome.result);
+            std::cout << "==> " << lines[next_printed];
+            if (!description.empty()) {
+                std::cout << " (" << description << ")";
+                failed = true;
+            }
+            std::cout << " <==" << std::endl << outcome.result.stdout_data;
+            std::cerr << outcome.result.stderr_data;
+            print_items(outcome.result);
+            // Printed output is not needed anymore
+            outcome.result = RunnerClient::Result();
+        }
+        if (next_printed == outcomes.size()) {
+            client.close();
+        }
+    };
+    for (size_t i = 0; i < commands.size(); ++i) {
+        client.run(commands[i], [&, i](boost::system::error_code ec, RunnerClient::Result& result) {
+            outcomes[i].done = true;
+            outcomes[i].ec = ec;
+            outcomes[i].result = std::move(result);
+            print_ready();
+        });
+    }
+    io_service.run();
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        auto options = parse_options(argc, argv);
+        boost::asio::io_service io_service;
+        RunnerClient client(io_service, make_endpoint(options), options.connections, options.depth);
+
+        if (options.file.empty()) {
+            return run_command(io_service, client, options.args, options.verbose);
+        }
+        return run_file(io_service, client, options.file);
+    } catch (const std::exception& e) {
+        std::cerr << "remote-run: " << e.what() << std::endl;
+    }
+    return failure_exit_code;
+}
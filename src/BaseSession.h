@@ -1,9 +1,17 @@
 #ifndef BASE_SESSION_H
 #define BASE_SESSION_H
 
+#include <sys/types.h>
+#include <sys/resource.h>
+
 /* This class needed for polymorphic dispatch when handling SIGCHLD */
 struct BaseSession {
-    virtual void handle_child_exit() = 0;
+    /*
+        Called by the server after child 'pid' is reaped, 'status' is waitpid status,
+        'usage' is resource usage of the child.
+        Implementation must not block, it is called from the reaper handler.
+    */
+    virtual void handle_child_exit(pid_t pid, int status, const rusage& usage) = 0;
 
     virtual ~BaseSession() = default;
 };
@@ -0,0 +1,336 @@
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "ChildTask.h"
+
+ChildTask::ChildTask(boost::asio::io_service& io_service, size_t id, int stdout_fd, int stderr_fd,
+    size_t stage_count)
+    : id_(id),
+    strand_(nullptr),
+    stdout_stream_(io_service),
+    stderr_stream_(io_service),
+    timeout_(0),
+    splicing_(false),
+    output_limit_(0),
+    output_policy_(OutputPolicy::head),
+    truncation_(0),
+    open_streams_(0),
+    paused_(false),
+    stdout_parked_(false),
+    stderr_parked_(false),
+    exited_(false),
+    status_(0),
+    running_stages_(stage_count),
+    launched_at_(clock_type::now())
+{
+    // Output written to files has no pipe
+    if (stdout_fd != -1) {
+        stdout_stream_.assign(stdout_fd);
+        ++open_streams_;
+    }
+    if (stderr_fd != -1) {
+        stderr_stream_.assign(stderr_fd);
+        ++open_streams_;
+    }
+    if (stage_count > 1) {
+        stage_statuses_.resize(stage_count);
+    }
+}
+
+void ChildTask::start(boost::asio::io_service::strand& strand,
+    output_handler on_output, finish_handler on_finish) {
+
+    strand_ = &strand;
+    on_output_ = on_output;
+    on_finish_ = on_finish;
+
+    if (stdout_stream_.is_open()) {
+        read_output(stdout_stream_, stdout_buf_, Stream::output);
+    }
+    if (stderr_stream_.is_open()) {
+        read_output(stderr_stream_, stderr_buf_, Stream::error);
+    }
+    // Task without pipes may be already exited
+    try_finish();
+}
+
+void ChildTask::set_splice_handler(splice_handler on_splice) {
+    on_splice_ = on_splice;
+    splicing_ = static_cast<bool>(on_splice);
+}
+
+void ChildTask::set_output_limit(size_t limit, OutputPolicy policy, limit_handler on_limit) {
+    output_limit_ = limit;
+    output_policy_ = policy;
+    on_limit_ = on_limit;
+}
+
+void ChildTask::read_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type) {
+    if (paused_) {
+        // Read is issued again by 'unpause_output'
+        (stream_type == Stream::output ? stdout_parked_ : stderr_parked_) = true;
+        return;
+    }
+    if (splicing_) {
+        wait_output(stream, buf, stream_type);
+        return;
+    }
+    auto self(shared_from_this());
+
+    stream.async_read_some(boost::asio::buffer(buf, buffer_length),
+        strand_->wrap([this, self, &stream, buf, stream_type](boost::system::error_code ec, size_t length) {
+            handle_output(stream, buf, stream_type, ec, length);
+        }));
+}
+
+void ChildTask::wait_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type) {
+    auto self(shared_from_this());
+
+    // Wait for readiness first, so large output can be spliced instead of read
+    stream.async_wait(boost::asio::posix::descriptor_base::wait_read,
+        strand_->wrap([this, self, &stream, buf, stream_type](boost::system::error_code ec) {
+            if (ec) {
+                handle_output(stream, buf, stream_type, ec, 0);
+                return;
+            }
+            int available = 0;
+            if (ioctl(stream.native_handle(), FIONREAD, &available) == 0
+                && static_cast<size_t>(available) >= settings::splice_threshold) {
+                size_t allowed = available;
+                if (output_limit_) {
+                    auto& total = output_state(stream_type).total;
+                    allowed = total < output_limit_ ? std::min(allowed, output_limit_ - total) : 0;
+                    total += allowed;
+                }
+                if (allowed) {
+                    // Owner moves data and resumes reading, bytes over limit are read and dropped
+                    on_splice_(stream_type, allowed);
+                    return;
+                }
+            }
+            stream.non_blocking(true, ec);
+            auto length = stream.read_some(boost::asio::buffer(buf, buffer_length), ec);
+            if (ec == boost::asio::error::would_block) {
+                wait_output(stream, buf, stream_type);
+                return;
+            }
+            handle_output(stream, buf, stream_type, ec, length);
+        }));
+}
+
+void ChildTask::handle_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type,
+    boost::system::error_code ec, size_t length) {
+
+    if (length) {
+        deliver(stream_type, buf, length);
+    }
+    if (!ec) {
+        read_output(stream, buf, stream_type);
+        return;
+    }
+    // EOF or pipe error, stream is drained
+    boost::system::error_code ignored;
+    stream.close(ignored);
+    --open_streams_;
+    try_finish();
+}
+
+ssize_t ChildTask::splice_to(Stream stream_type, int fd, size_t length) {
+    #ifdef __linux__
+    return splice(stream(stream_type).native_handle(), nullptr, fd, nullptr, length,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    #else
+    errno = ENOSYS;
+    return -1;
+    #endif
+}
+
+void ChildTask::resume_output(Stream stream_type) {
+    read_output(stream(stream_type), buffer(stream_type), stream_type);
+}
+
+void ChildTask::stop_splicing() {
+    splicing_ = false;
+}
+
+void ChildTask::pause_output() {
+    paused_ = true;
+}
+
+void ChildTask::unpause_output() {
+    paused_ = false;
+    if (stdout_parked_) {
+        stdout_parked_ = false;
+        read_output(stdout_stream_, stdout_buf_, Stream::output);
+    }
+    if (stderr_parked_) {
+        stderr_parked_ = false;
+        read_output(stderr_stream_, stderr_buf_, Stream::error);
+    }
+}
+
+void ChildTask::handle_exit(int status, const rusage& usage, size_t stage) {
+    usage_.add(usage);
+    if (stage_statuses_.empty()) {
+        status_ = status;
+    } else if (stage < stage_statuses_.size()) {
+        stage_statuses_[stage] = status;
+    }
+    if (--running_stages_) {
+        // Other stages are still running
+        return;
+    }
+    if (!stage_statuses_.empty()) {
+        status_ = pipeline_status(stage_statuses_);
+    }
+    exited_ = true;
+    exited_at_ = clock_type::now();
+    // Pipes may still hold data
+    try_finish();
+}
+
+void ChildTask::deliver(Stream stream_type, const char* data, size_t length) {
+    if (!output_limit_) {
+        // Forward chunk as soon as it arrives
+        on_output_(stream_type, data, length);
+        return;
+    }
+    if (output_policy_ == OutputPolicy::tail) {
+        keep_tail(stream_type, data, length);
+        return;
+    }
+    auto& total = output_state(stream_type).total;
+    auto allowed = total < output_limit_ ? std::min(length, output_limit_ - total) : 0;
+    total += length;
+    if (allowed) {
+        on_output_(stream_type, data, allowed);
+    }
+    if (allowed < length) {
+        exceed_limit(stream_type);
+    }
+}
+
+void ChildTask::keep_tail(Stream stream_type, const char* data, size_t length) {
+    auto& state = output_state(stream_type);
+    if (state.tail.size() < output_limit_) {
+        // Ring grows with output, small output takes small buffer
+        auto appended = std::min(length, output_limit_ - state.tail.size());
+        state.tail.insert(state.tail.end(), data, data + appended);
+        state.total += appended;
+        data += appended;
+        length -= appended;
+    }
+    if (length > output_limit_) {
+        // Only the last bytes of the chunk survive
+        state.total += length - output_limit_;
+        data += length - output_limit_;
+        length = output_limit_;
+    }
+    // Oldest byte is at 'total % output_limit_' once the ring is full
+    auto offset = state.total % output_limit_;
+    auto first = std::min(length, output_limit_ - offset);
+    std::memcpy(state.tail.data() + offset, data, first);
+    std::memcpy(state.tail.data(), data + first, length - first);
+    state.total += length;
+}
+
+void ChildTask::flush_tail(Stream stream_type) {
+    auto& state = output_state(stream_type);
+    if (state.tail.empty()) {
+        return;
+    }
+    if (state.total > output_limit_) {
+        exceed_limit(stream_type);
+    }
+    auto offset = state.total % output_limit_;
+    if (offset < state.tail.size()) {
+        on_output_(stream_type, state.tail.data() + offset, state.tail.size() - offset);
+    }
+    if (offset) {
+        on_output_(stream_type, state.tail.data(), offset);
+    }
+    std::vector<char>().swap(state.tail);
+}
+
+void ChildTask::exceed_limit(Stream stream_type) {
+    truncation_ |= stream_type == Stream::output ? truncated_stdout : truncated_stderr;
+    if (output_policy_ == OutputPolicy::kill && on_limit_) {
+        truncation_ |= killed_by_output_limit;
+        auto on_limit = on_limit_;
+        on_limit_ = nullptr;
+        on_limit();
+    }
+}
+
+void ChildTask::try_finish() {
+    if (!exited_ || open_streams_ != 0 || !on_finish_) {
+        return;
+    }
+    if (output_limit_ && output_policy_ == OutputPolicy::tail) {
+        // Kept tails go out before the status
+        flush_tail(Stream::output);
+        flush_tail(Stream::error);
+    }
+    auto on_finish = on_finish_;
+    // Release handlers, they can hold owner
+    on_output_ = nullptr;
+    on_splice_ = nullptr;
+    on_finish_ = nullptr;
+    on_limit_ = nullptr;
+    on_finish();
+}
+
+size_t ChildTask::id() const {
+    return id_;
+}
+
+bool ChildTask::exited() const {
+    return exited_;
+}
+
+int ChildTask::status() const {
+    return status_;
+}
+
+const std::vector<int>& ChildTask::stage_statuses() const {
+    return stage_statuses_;
+}
+
+const ResourceUsage& ChildTask::usage() const {
+    return usage_;
+}
+
+ChildTask::clock_type::time_point ChildTask::launched_at() const {
+    return launched_at_;
+}
+
+ChildTask::clock_type::time_point ChildTask::exited_at() const {
+    return exited_at_;
+}
+
+TimingWheel::timer_id ChildTask::timeout() const {
+    return timeout_;
+}
+
+void ChildTask::set_timeout(TimingWheel::timer_id id) {
+    timeout_ = id;
+}
+
+boost::asio::posix::stream_descriptor& ChildTask::stream(Stream stream_type) {
+    return stream_type == Stream::output ? stdout_stream_ : stderr_stream_;
+}
+
+unsigned ChildTask::truncation() const {
+    return truncation_;
+}
+
+ChildTask::OutputState& ChildTask::output_state(Stream stream_type) {
+    return stream_type == Stream::output ? stdout_state_ : stderr_state_;
+}
+
+char* ChildTask::buffer(Stream stream_type) {
+    return stream_type == Stream::output ? stdout_buf_ : stderr_buf_;
+}
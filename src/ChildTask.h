@@ -0,0 +1,225 @@
+#ifndef CHILD_TASK_H
+#define CHILD_TASK_H
+
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "settings.h"
+#include "types.h"
+#include "TimingWheel.h"
+
+/*
+    Output pipes, timeout entry and exit state of one launched child,
+    or of all children of a pipeline, which share stderr pipe.
+    All methods must be called from the owner's strand.
+*/
+class ChildTask : public std::enable_shared_from_this<ChildTask> {
+public: // structs
+
+    enum class Stream { output, error };
+
+    typedef std::function<void(Stream stream, const char* data, size_t length)> output_handler;
+    typedef std::function<void(Stream stream, size_t length)> splice_handler;
+    typedef std::function<void()> finish_handler;
+    typedef std::function<void()> limit_handler;
+
+    typedef std::chrono::steady_clock clock_type;
+
+public: // constructors
+
+    /*
+        Takes ownership of pipe read ends, -1 if the stream is not piped to the daemon.
+    */
+    ChildTask(boost::asio::io_service& io_service, size_t id, int stdout_fd, int stderr_fd,
+        size_t stage_count = 1);
+
+    /* Noncopyable */
+    ChildTask(const ChildTask&) = delete;
+    ChildTask& operator = (const ChildTask&) = delete;
+
+public: // methods
+
+    /*
+        Starts reading child pipes. Every chunk is passed to 'on_output'.
+        'on_finish' is called once when child exited and both pipes are drained.
+        Handlers are wrapped by 'strand'.
+    */
+    void start(boost::asio::io_service::strand& strand,
+        output_handler on_output, finish_handler on_finish);
+
+    /*
+        Enables splice mode, must be called before 'start'.
+        When at least 'settings::splice_threshold' bytes are buffered in a pipe,
+        'on_splice' is called instead of reading them. Reading of that pipe
+        is paused until 'resume_output' is called, so owner can move
+        exactly 'length' bytes with 'splice_to'.
+    */
+    void set_splice_handler(splice_handler on_splice);
+
+    /*
+        Limits output passed to the owner to 'limit' bytes per stream,
+        must be called before 'start'. Tail policy keeps last bytes
+        in a ring buffer and passes them right before 'on_finish',
+        so it must not be used with splice mode.
+        Kill policy calls 'on_limit' once, owner kills the child.
+        Pipes are drained to the end in any case.
+    */
+    void set_output_limit(size_t limit, OutputPolicy policy, limit_handler on_limit);
+
+    /*
+        Moves up to 'length' bytes from child pipe to 'fd' without copying
+        them to user space. Returns number of bytes moved or -1 with errno set,
+        EAGAIN means that 'fd' is not writable.
+    */
+    ssize_t splice_to(Stream stream, int fd, size_t length);
+
+    /*
+        Resumes reading of the pipe paused by splice handler.
+    */
+    void resume_output(Stream stream);
+
+    /*
+        Leaves splice mode, bytes announced to splice handler and all further
+        output are read and passed to 'on_output'. Owner which can't move
+        data anymore uses it to drain pipes, together with 'resume_output'.
+    */
+    void stop_splicing();
+
+    /*
+        Stops reading both pipes after chunks already being read,
+        so child blocks on full pipe while owner can't keep up.
+    */
+    void pause_output();
+
+    /*
+        Restarts reading of pipes stopped by 'pause_output'.
+    */
+    void unpause_output();
+
+    /*
+        Records exit status and resource usage of reaped child of pipeline 'stage'.
+        Task is exited once children of all stages are reaped.
+    */
+    void handle_exit(int status, const rusage& usage, size_t stage = 0);
+
+    bool exited() const;
+
+    size_t id() const;
+
+    /*
+        Exit status of the child, for pipeline see 'pipeline_status'.
+    */
+    int status() const;
+
+    /*
+        Exit statuses of pipeline stages, empty for single child.
+    */
+    const std::vector<int>& stage_statuses() const;
+
+    /*
+        'TruncationFlag' bits of output dropped because of output limit.
+    */
+    unsigned truncation() const;
+
+    /*
+        Resources used by reaped children.
+    */
+    const ResourceUsage& usage() const;
+
+    /*
+        Time of task creation, right after child spawn.
+    */
+    clock_type::time_point launched_at() const;
+
+    /*
+        Time when exit of the child was handled.
+    */
+    clock_type::time_point exited_at() const;
+
+    /*
+        Timing wheel entry killing the child, owner cancels it on exit.
+    */
+    TimingWheel::timer_id timeout() const;
+
+    void set_timeout(TimingWheel::timer_id id);
+
+private: // methods
+
+    void read_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type);
+    void wait_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type);
+    void handle_output(boost::asio::posix::stream_descriptor& stream, char* buf, Stream stream_type,
+        boost::system::error_code ec, size_t length);
+    void deliver(Stream stream_type, const char* data, size_t length);
+    void keep_tail(Stream stream_type, const char* data, size_t length);
+    void flush_tail(Stream stream_type);
+    void exceed_limit(Stream stream_type);
+    void try_finish();
+
+    boost::asio::posix::stream_descriptor& stream(Stream stream_type);
+    char* buffer(Stream stream_type);
+
+private: // structs
+
+    struct OutputState {
+        // Bytes produced by the child, including dropped ones
+        size_t total;
+        // Ring buffer of last bytes for tail policy
+        std::vector<char> tail;
+
+        OutputState() : total(0) {}
+    };
+
+    OutputState& output_state(Stream stream_type);
+
+private: // fields
+
+    size_t id_;
+
+    boost::asio::io_service::strand* strand_;
+
+    boost::asio::posix::stream_descriptor stdout_stream_;
+    boost::asio::posix::stream_descriptor stderr_stream_;
+
+    TimingWheel::timer_id timeout_;
+
+    output_handler on_output_;
+    splice_handler on_splice_;
+    // Cleared by 'stop_splicing', handler itself may be running then
+    bool splicing_;
+    finish_handler on_finish_;
+    limit_handler on_limit_;
+
+    // Bytes per stream, 0 means unlimited
+    size_t output_limit_;
+    OutputPolicy output_policy_;
+    OutputState stdout_state_;
+    OutputState stderr_state_;
+    unsigned truncation_;
+
+    // Number of child pipes which are not drained yet
+    size_t open_streams_;
+    // Set by owner backpressure, reads are parked instead of issued
+    bool paused_;
+    bool stdout_parked_;
+    bool stderr_parked_;
+    // Set when all children were reaped
+    bool exited_;
+    int status_;
+    // Children which are not reaped yet
+    size_t running_stages_;
+    std::vector<int> stage_statuses_;
+    ResourceUsage usage_;
+
+    clock_type::time_point launched_at_;
+    clock_type::time_point exited_at_;
+
+    enum {buffer_length = settings::process_buffer_length};
+    char stdout_buf_[buffer_length];
+    char stderr_buf_[buffer_length];
+};
+
+#endif // CHILD_TASK_H
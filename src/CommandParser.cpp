@@ -0,0 +1,26 @@
+#include "CommandParser.h"
+
+CommandParser::CommandParser()
+    : begin_(0)
+{}
+
+void CommandParser::append(const char* data, size_t length) {
+    if (begin_ == buffer_.size()) {
+        // Everything is consumed
+        buffer_.clear();
+        begin_ = 0;
+    } else if (begin_ > buffer_.size() / 2) {
+        // Consumed part dominates, move tail to the front
+        buffer_.erase(buffer_.begin(), buffer_.begin() + begin_);
+        begin_ = 0;
+    }
+    buffer_.insert(buffer_.end(), data, data + length);
+}
+
+bool CommandParser::is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+size_t CommandParser::pending() const {
+    return buffer_.size() - begin_;
+}
@@ -0,0 +1,71 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+    Incremental parser of newline terminated commands.
+    Input is appended to one buffer which is scanned only once,
+    consumed bytes are dropped in bulk, not per command.
+*/
+class CommandParser {
+public: // constructors
+
+    CommandParser();
+
+public: // methods
+
+    /*
+        Appends 'length' bytes of 'data' and calls 'handler(const std::string&)'
+        for every complete command. Commands are trimmed, empty commands are skipped.
+        Incomplete tail is kept until next call.
+    */
+    template <typename Handler>
+    void parse(const char* data, size_t length, Handler handler);
+
+    /*
+        Returns number of buffered bytes of incomplete command.
+    */
+    size_t pending() const;
+
+private: // methods
+
+    void append(const char* data, size_t length);
+    static bool is_space(char c);
+
+private: // fields
+
+    std::vector<char> buffer_;
+    // Start of the first unconsumed command
+    size_t begin_;
+};
+
+template <typename Handler>
+void CommandParser::parse(const char* data, size_t length, Handler handler) {
+    // Only new bytes need to be scanned, buffered tail has no newline
+    size_t scan = buffer_.size() - begin_;
+    append(data, length);
+
+    const char* base = buffer_.data() + begin_;
+    const char* end = buffer_.data() + buffer_.size();
+    const char* line = base;
+    const char* pos = base + scan;
+
+    while ((pos = static_cast<const char*>(memchr(pos, '\n', end - pos))) != nullptr) {
+        // Command can't consist only of whitespace symbols
+        const char* first = line;
+        const char* last = pos;
+        while (first != last && is_space(*first)) ++first;
+        while (last != first && is_space(*(last - 1))) --last;
+
+        if (first != last) {
+            handler(std::string(first, last));
+        }
+        line = ++pos;
+    }
+    begin_ += line - base;
+}
+
+#endif // COMMAND_PARSER_H
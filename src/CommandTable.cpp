@@ -0,0 +1,52 @@
+#include <functional>
+
+#include "CommandTable.h"
+
+CommandTable::CommandTable(const config_data_type& config)
+    : size_(config.size())
+{
+    // Keep load factor at most 1/2, capacity is power of two
+    size_t capacity = 8;
+    while (capacity < config.size() * 2) {
+        capacity <<= 1;
+    }
+    slots_.resize(capacity);
+    mask_ = capacity - 1;
+
+    for (auto& command : config) {
+        auto cmd_hash = hash(command.first);
+        auto index = cmd_hash & mask_;
+        // Commands in config are unique, so just look for empty slot
+        while (slots_[index].hash) {
+            index = (index + 1) & mask_;
+        }
+        slots_[index].hash = cmd_hash;
+        slots_[index].cmd = command.first;
+        slots_[index].config = command.second;
+    }
+}
+
+const CommandConfig* CommandTable::find(const std::string& cmd) const {
+    auto cmd_hash = hash(cmd);
+    for (auto index = cmd_hash & mask_; slots_[index].hash; index = (index + 1) & mask_) {
+        auto& slot = slots_[index];
+        if (slot.hash == cmd_hash && slot.cmd == cmd) {
+            return &slot.config;
+        }
+    }
+    return nullptr;
+}
+
+size_t CommandTable::size() const {
+    return size_;
+}
+
+bool CommandTable::empty() const {
+    return size_ == 0;
+}
+
+size_t CommandTable::hash(const std::string& cmd) {
+    auto value = std::hash<std::string>()(cmd);
+    // Zero is reserved for empty slots
+    return value ? value : 1;
+}
@@ -0,0 +1,51 @@
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <vector>
+#include <string>
+
+#include "types.h"
+
+/*
+    Immutable open addressing hash table of configured commands.
+    Built once per config load, lookups need no locking.
+*/
+class CommandTable {
+public: // constructors
+
+    CommandTable(const config_data_type& config);
+
+public: // methods
+
+    /*
+        Returns configuration of 'cmd' or nullptr if command is not allowed.
+    */
+    const CommandConfig* find(const std::string& cmd) const;
+
+    size_t size() const;
+
+    bool empty() const;
+
+private: // structs
+
+    struct Slot {
+        // Zero hash marks empty slot
+        size_t hash;
+        std::string cmd;
+        CommandConfig config;
+
+        Slot() : hash(0) {}
+    };
+
+private: // methods
+
+    static size_t hash(const std::string& cmd);
+
+private: // fields
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t size_;
+};
+
+#endif // COMMAND_TABLE_H
@@ -20,14 +20,55 @@ config_data_type ConfigParser::parse_config() const {
     while (std::getline(in, line)) {
         std::stringstream stream(line);
         std::string cmd;
-        std::string program;
+        CommandConfig command;
         stream >> cmd;
-        stream >> program;
-        if (!cmd.empty() && !program.empty()) {
-            config_data[cmd] = program;                                                                                                                                                                                                          
+        stream >> command.program;
+        if (!cmd.empty() && !command.program.empty() && parse_options(stream, command)) {
+            config_data[cmd] = command;
         }
     }
 
     return config_data;
 }
 
+bool ConfigParser::parse_options(std::istream& stream, CommandConfig& command) const {
+    std::string option;
+    while (stream >> option) {
+        if (option == "cacheable") {
+            if (!(stream >> command.cache_ttl)) {
+                return false;
+            }
+        } else if (option == "worker") {
+            if (!(stream >> command.worker_instances) || !command.worker_instances) {
+                return false;
+            }
+        } else if (option == "recycle") {
+            if (!(stream >> command.worker_recycle)) {
+                return false;
+            }
+        } else if (option == "timeout") {
+            if (!(stream >> command.timeout) || !command.timeout) {
+                return false;
+            }
+        } else if (option == "output_limit") {
+            std::string policy;
+            if (!(stream >> command.output_limit >> policy) || !command.output_limit) {
+                return false;
+            }
+            if (policy == "head") {
+                command.output_policy = OutputPolicy::head;
+            } else if (policy == "tail") {
+                command.output_policy = OutputPolicy::tail;
+            } else if (policy == "kill") {
+                command.output_policy = OutputPolicy::kill;
+            } else {
+                return false;
+            }
+        } else {
+            // Unknown option
+            return false;
+        }
+    }
+    return true;
+}
+
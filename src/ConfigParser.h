@@ -17,14 +17,33 @@ public: // methods
         Returns empty config data on invalid config file.
         This method should not throw any exception.
         Config format:
-            <cmd> <program>
-            <cmd> <program>
+            <cmd> <program> [<option> ...]
+            <cmd> <program> [<option> ...]
             ... 
 
         'program' is an executable name for corresponding 'cmd'.
+        Options:
+            cacheable <ttl> - results of identical requests are cached
+                for 'ttl' seconds and concurrent identical requests
+                share one execution.
+            worker <instances> - program is a persistent worker, up to
+                'instances' long-lived instances serve requests over
+                stdin/stdout (see WorkerPool).
+            recycle <requests> - worker instance is respawned after
+                serving 'requests' requests.
+            timeout <seconds> - command is killed after 'seconds' instead of
+                the server-wide timeout.
+            output_limit <bytes> <head|tail|kill> - at most 'bytes' of stdout
+                and of stderr are sent, first ones, last ones, or first ones
+                and the child is killed.
+        Lines with unknown or malformed options are skipped.
     */
     config_data_type parse_config() const;
 
+private: // methods
+
+    bool parse_options(std::istream& stream, CommandConfig& command) const;
+
 private: // fields
     
     std::string config_name_;
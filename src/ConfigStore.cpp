@@ -0,0 +1,41 @@
+#include "ConfigStore.h"
+
+namespace {
+
+/* Per-thread copy of last seen snapshot */
+struct CachedSnapshot {
+    const ConfigStore* owner;
+    uint64_t version;
+    config_ptr config;
+};
+
+thread_local CachedSnapshot cached_snapshot = {nullptr, 0, config_ptr()};
+
+}
+
+ConfigStore::ConfigStore(const config_ptr& config)
+    : config_(config),
+    version_(1)
+{}
+
+const CommandTable& ConfigStore::current() const {
+    auto version = version_.load(std::memory_order_acquire);
+    auto& cached = cached_snapshot;
+
+    if (cached.owner != this || cached.version != version) {
+        // Snapshot was replaced since last lookup of this thread
+        cached.config = std::atomic_load(&config_);
+        cached.owner = this;
+        cached.version = version;
+    }
+    return *cached.config;
+}
+
+config_ptr ConfigStore::load() const {
+    return std::atomic_load(&config_);
+}
+
+void ConfigStore::store(const config_ptr& config) {
+    std::atomic_store(&config_, config);
+    version_.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,54 @@
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "CommandTable.h"
+
+typedef std::shared_ptr<const CommandTable> config_ptr;
+
+/*
+    RCU-style holder of current config snapshot.
+    Snapshots are immutable, new snapshot is published by pointer swap,
+    readers keep using old one until they look up again.
+*/
+class ConfigStore {
+public: // constructors
+
+    ConfigStore(const config_ptr& config);
+
+    /* Noncopyable */
+    ConfigStore(const ConfigStore&) = delete;
+    ConfigStore& operator = (const ConfigStore&) = delete;
+
+public: // methods
+
+    /*
+        Returns current snapshot.
+        Every thread caches snapshot, so when config is not changed
+        this costs one atomic load and no reference counting.
+        Returned reference is valid until next call from the same thread.
+    */
+    const CommandTable& current() const;
+
+    /*
+        Returns current snapshot with shared ownership.
+    */
+    config_ptr load() const;
+
+    /*
+        Publishes new snapshot.
+    */
+    void store(const config_ptr& config);
+
+private: // fields
+
+    // Accessed only with std::atomic_load and std::atomic_store
+    config_ptr config_;
+    // Incremented after every store
+    std::atomic<uint64_t> version_;
+};
+
+#endif // CONFIG_STORE_H
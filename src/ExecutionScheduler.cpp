@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+#include <boost/thread.hpp>
+
+#include "settings.h"
+#include "ExecutionScheduler.h"
+
+namespace {
+
+// Level 'n' holds expected runtimes below 2^n milliseconds, the last one the rest
+const size_t level_count = 24;
+
+}
+
+ExecutionScheduler::ExecutionScheduler(size_t max_running)
+    : max_running_(max_running ? max_running : std::max(1u, boost::thread::hardware_concurrency())),
+    running_(0),
+    queued_(0),
+    granted_(0),
+    total_wait_us_(0),
+    max_wait_us_(0)
+{}
+
+void ExecutionScheduler::acquire(const void* client, const std::string& name, grant_handler on_grant) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    auto& queue = requests_[client];
+    if (queue.levels.empty()) {
+        // Client joins the end of round-robin order with no credit
+        queue.deficit_us = 0;
+        clients_.push_back(client);
+        if (clients_.size() == 1) {
+            start_turn();
+        }
+    }
+    auto expected_us = estimate(name);
+    queue.levels[level(expected_us)].push_back(Request{on_grant, clock_type::now(), expected_us});
+    ++queued_;
+
+    auto handler = grant_next();
+    lock.unlock();
+
+    if (handler) {
+        handler();
+    }
+}
+
+void ExecutionScheduler::release() {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    // Every release must match a grant, extra one breaks the server-wide limit
+    assert(running_ && "execution slot is released twice");
+    if (!running_) {
+        std::cerr << "Execution slot is released without grant" << std::endl;
+        return;
+    }
+    --running_;
+    auto handler = grant_next();
+    lock.unlock();
+
+    if (handler) {
+        handler();
+    }
+}
+
+void ExecutionScheduler::record_runtime(const std::string& name, duration_type runtime) {
+    auto runtime_us = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::microseconds>(runtime).count());
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    auto it = runtimes_.find(name);
+    if (it == runtimes_.end()) {
+        // First runtime replaces the default guess
+        runtimes_.insert(std::make_pair(name, runtime_us));
+        return;
+    }
+    it->second += settings::scheduler_runtime_weight * (runtime_us - it->second);
+}
+
+uint64_t ExecutionScheduler::expected_runtime_us(const std::string& name) const {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    return estimate(name);
+}
+
+uint64_t ExecutionScheduler::estimate(const std::string& name) const {
+    auto it = runtimes_.find(name);
+    if (it == runtimes_.end()) {
+        return settings::scheduler_default_runtime_ms * 1000;
+    }
+    // Zero estimate would make the ratio infinite
+    return std::max<uint64_t>(static_cast<uint64_t>(it->second), 1);
+}
+
+size_t ExecutionScheduler::level(uint64_t expected_us) {
+    size_t result = 0;
+    for (auto ms = expected_us / 1000; ms && result + 1 < level_count; ms >>= 1) {
+        ++result;
+    }
+    return result;
+}
+
+ExecutionScheduler::grant_handler ExecutionScheduler::grant_next() {
+    if (running_ >= max_running_ || clients_.empty()) {
+        return grant_handler();
+    }
+    auto now = clock_type::now();
+    const uint64_t quantum_us = settings::scheduler_quantum_ms * 1000;
+
+    // Turn passes on until a client has credit for its next request
+    size_t turns = 0;
+    auto chosen = next_request(requests_[clients_.front()].levels, now);
+    while (chosen->second.front().expected_us > requests_[clients_.front()].deficit_us) {
+        if (++turns == clients_.size()) {
+            // Nobody had enough credit for a whole round, skip the rounds in which
+            // nobody would have, instead of passing turns quantum by quantum
+            uint64_t rounds = UINT64_MAX;
+            for (auto& client : requests_) {
+                auto expected_us = next_request(client.second.levels, now)->second.front().expected_us;
+                auto missing_us = expected_us - std::min(expected_us, client.second.deficit_us);
+                rounds = std::min(rounds, (missing_us + quantum_us - 1) / quantum_us);
+            }
+            for (auto& client : requests_) {
+                client.second.deficit_us += (rounds - 1) * quantum_us;
+            }
+            turns = 0;
+        }
+        clients_.push_back(clients_.front());
+        clients_.pop_front();
+        start_turn();
+        chosen = next_request(requests_[clients_.front()].levels, now);
+    }
+
+    auto client = clients_.front();
+    auto& queue = requests_[client];
+    auto request = std::move(chosen->second.front());
+    chosen->second.pop_front();
+    if (chosen->second.empty()) {
+        queue.levels.erase(chosen);
+    }
+    queue.deficit_us -= request.expected_us;
+    if (queue.levels.empty()) {
+        // Client leaves round-robin order, its credit is dropped
+        requests_.erase(client);
+        clients_.pop_front();
+        if (!clients_.empty()) {
+            start_turn();
+        }
+    }
+    --queued_;
+    ++running_;
+
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(now - request.enqueued).count();
+    ++granted_;
+    total_wait_us_ += wait;
+    max_wait_us_ = std::max<uint64_t>(max_wait_us_, wait);
+
+    return request.on_grant;
+}
+
+void ExecutionScheduler::start_turn() {
+    requests_[clients_.front()].deficit_us += settings::scheduler_quantum_ms * 1000;
+}
+
+// Oldest request of every level competes by response ratio
+ExecutionScheduler::request_levels::iterator ExecutionScheduler::next_request(request_levels& levels,
+    clock_type::time_point now) {
+
+    auto chosen = levels.end();
+    double best_ratio = 0;
+    for (auto it = levels.begin(); it != levels.end(); ++it) {
+        auto& head = it->second.front();
+        auto wait_us = std::chrono::duration_cast<std::chrono::microseconds>(now - head.enqueued).count();
+        auto ratio = static_cast<double>(wait_us + head.expected_us) / head.expected_us;
+        if (ratio > best_ratio) {
+            best_ratio = ratio;
+            chosen = it;
+        }
+    }
+    return chosen;
+}
+
+ExecutionScheduler::Stats ExecutionScheduler::stats() const {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    Stats stats;
+    stats.max_running = max_running_;
+    stats.running = running_;
+    stats.queued = queued_;
+    stats.queued_clients = clients_.size();
+    stats.granted = granted_;
+    stats.total_wait_us = total_wait_us_;
+    stats.max_wait_us = max_wait_us_;
+    stats.estimated_commands = runtimes_.size();
+    return stats;
+}
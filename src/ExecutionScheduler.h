@@ -0,0 +1,139 @@
+#ifndef EXECUTION_SCHEDULER_H
+#define EXECUTION_SCHEDULER_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include <boost/thread/mutex.hpp>
+
+/*
+    Server-wide admission control for child processes.
+    At most 'max_running' execution slots are granted at a time.
+    Every configured command has runtime estimate, an exponentially weighted
+    average of its recorded runtimes.
+    Waiting clients are served by deficit round-robin weighted by expected runtime:
+    on its turn a client earns 'settings::scheduler_quantum_ms' of runtime credit
+    and is granted slots while its credit covers the expected runtime of its next
+    request, unspent credit is kept for the next turn. So every waiting client
+    gets about the same share of slot time, clients of short commands get many
+    slots per turn, and one client with many queued commands can't starve the others.
+    Next request of a client is the one with the highest response ratio
+    '(wait + expected) / expected', so its short commands pass its long ones,
+    while the ratio of a waiting long command keeps growing and it is never starved.
+    Requests of a client are kept in levels of power-of-two expected runtimes,
+    FIFO within a level, and only level heads are compared.
+*/
+class ExecutionScheduler {
+public: // structs
+
+    typedef std::function<void()> grant_handler;
+    typedef std::chrono::steady_clock::duration duration_type;
+
+    struct Stats {
+        size_t max_running;
+        size_t running;
+        // Number of slot requests waiting for grant
+        size_t queued;
+        // Number of clients waiting for grant
+        size_t queued_clients;
+        uint64_t granted;
+        // Wait time of granted requests, microseconds
+        uint64_t total_wait_us;
+        uint64_t max_wait_us;
+        // Number of commands with runtime estimate
+        size_t estimated_commands;
+    };
+
+public: // constructors
+
+    /* Zero 'max_running' means number of hardware threads */
+    ExecutionScheduler(size_t max_running);
+
+    /* Noncopyable */
+    ExecutionScheduler(const ExecutionScheduler&) = delete;
+    ExecutionScheduler& operator = (const ExecutionScheduler&) = delete;
+
+public: // methods
+
+    /*
+        Requests one execution slot for 'client' to run configured command 'name'.
+        'on_grant' is called once the slot is granted, possibly immediately
+        and possibly from the thread which releases another slot,
+        so it must not block and must not call scheduler methods directly.
+        Requests are not granted in order, handler must launch its own command.
+    */
+    void acquire(const void* client, const std::string& name, grant_handler on_grant);
+
+    /*
+        Returns granted slot. Release without grant is a bug, it is reported
+        and ignored.
+    */
+    void release();
+
+    /*
+        Updates runtime estimate of command 'name' with runtime of its child.
+    */
+    void record_runtime(const std::string& name, duration_type runtime);
+
+    /*
+        Expected runtime of command 'name', microseconds.
+    */
+    uint64_t expected_runtime_us(const std::string& name) const;
+
+    Stats stats() const;
+
+private: // structs
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Request {
+        grant_handler on_grant;
+        clock_type::time_point enqueued;
+        uint64_t expected_us;
+    };
+
+    // Pending requests of one client by level of expected runtime, only non-empty levels
+    typedef std::map<size_t, std::deque<Request>> request_levels;
+
+    struct ClientQueue {
+        request_levels levels;
+        // Expected runtime the client can still be granted, microseconds
+        uint64_t deficit_us;
+    };
+
+private: // methods
+
+    // Must be synchronized, returns empty handler if nothing can be granted
+    grant_handler grant_next();
+    void start_turn();
+    request_levels::iterator next_request(request_levels& levels, clock_type::time_point now);
+    uint64_t estimate(const std::string& name) const;
+    static size_t level(uint64_t expected_us);
+
+private: // fields
+
+    size_t max_running_;
+    size_t running_;
+
+    // Pending requests of every waiting client
+    std::map<const void*, ClientQueue> requests_;
+    // Round-robin order of waiting clients
+    std::deque<const void*> clients_;
+    size_t queued_;
+
+    // Runtime estimates of commands, microseconds
+    std::map<std::string, double> runtimes_;
+
+    uint64_t granted_;
+    uint64_t total_wait_us_;
+    uint64_t max_wait_us_;
+
+    mutable boost::mutex mutex_;
+};
+
+#endif // EXECUTION_SCHEDULER_H
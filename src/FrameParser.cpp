@@ -0,0 +1,67 @@
+#include "FrameParser.h"
+
+const char FrameParser::magic[4] = {'\0', 'R', 'R', 'B'};
+const size_t FrameParser::header_length;
+
+FrameParser::FrameParser()
+    : begin_(0),
+    handshake_done_(false),
+    failed_(false)
+{}
+
+void FrameParser::append(const char* data, size_t length) {
+    if (begin_ == buffer_.size()) {
+        // Everything is consumed
+        buffer_.clear();
+        begin_ = 0;
+    } else if (begin_ > buffer_.size() / 2) {
+        // Consumed part dominates, move tail to the front
+        buffer_.erase(buffer_.begin(), buffer_.begin() + begin_);
+        begin_ = 0;
+    }
+    buffer_.insert(buffer_.end(), data, data + length);
+}
+
+bool FrameParser::parse_request(const char* payload, size_t length, std::vector<std::string>& args) const {
+    if (length < 4) {
+        return false;
+    }
+    auto argc = get_u32(payload);
+    size_t pos = 4;
+    // Every argument takes at least its length prefix
+    if (!argc || argc > (length - pos) / 4) {
+        return false;
+    }
+    for (uint32_t i = 0; i < argc; ++i) {
+        if (length - pos < 4) {
+            return false;
+        }
+        auto arg_length = get_u32(payload + pos);
+        pos += 4;
+        if (arg_length > length - pos) {
+            return false;
+        }
+        args.emplace_back(payload + pos, arg_length);
+        pos += arg_length;
+    }
+    // Trailing garbage means client and server disagree on framing
+    return pos == length;
+}
+
+std::string FrameParser::header(Type type, uint32_t id, uint32_t length) {
+    std::string header;
+    header.reserve(header_length);
+    header += static_cast<char>(type);
+    for (auto value : {id, length}) {
+        header += static_cast<char>(value >> 24);
+        header += static_cast<char>(value >> 16);
+        header += static_cast<char>(value >> 8);
+        header += static_cast<char>(value);
+    }
+    return header;
+}
+
+uint32_t FrameParser::get_u32(const char* data) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
@@ -0,0 +1,119 @@
+#ifndef FRAME_PARSER_H
+#define FRAME_PARSER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "settings.h"
+
+/*
+    Incremental parser of the binary protocol.
+    Binary connection starts with 'magic', server answers with the same bytes.
+    Then both sides exchange frames:
+        <u8 type> <u32 request id> <u32 payload length> <payload>
+    Request payload is argv: <u32 argc> and 'argc' times <u32 length> <bytes>.
+    Stdout and stderr payloads are output bytes, exit payload is <u32 waitpid status>,
+    error payload is a message, memfd payload is <u64 stdout size> <u64 stderr size>
+    of output files passed along with the frame, batch item payload is a result
+    of one command of a batch request, usage payload is resource usage of children
+    sent before exit. Integers are big-endian.
+    Request frames get ids in order like text commands, their id field is ignored.
+*/
+class FrameParser {
+public: // structs
+
+    enum class Type : uint8_t {
+        request = 1,
+        stdout_chunk = 2,
+        stderr_chunk = 3,
+        exit = 4,
+        error = 5,
+        memfd = 6,
+        batch_item = 7,
+        usage = 8
+    };
+
+public: // constructors
+
+    FrameParser();
+
+public: // methods
+
+    /*
+        Appends 'length' bytes of 'data' and calls
+        'handler(std::vector<std::string>& args)' for every complete request frame.
+        Returns false if input is malformed, nothing can be parsed after that.
+    */
+    template <typename Handler>
+    bool parse(const char* data, size_t length, Handler handler);
+
+    /*
+        Returns frame header, 'length' payload bytes must follow it.
+    */
+    static std::string header(Type type, uint32_t id, uint32_t length);
+
+public: // constants
+
+    static const char magic[4];
+    static const size_t header_length = 9;
+
+private: // methods
+
+    void append(const char* data, size_t length);
+    bool parse_request(const char* payload, size_t length, std::vector<std::string>& args) const;
+    static uint32_t get_u32(const char* data);
+
+private: // fields
+
+    std::vector<char> buffer_;
+    // Start of the first unconsumed frame
+    size_t begin_;
+    bool handshake_done_;
+    bool failed_;
+};
+
+template <typename Handler>
+bool FrameParser::parse(const char* data, size_t length, Handler handler) {
+    if (failed_) {
+        return false;
+    }
+    append(data, length);
+
+    if (!handshake_done_) {
+        if (buffer_.size() - begin_ < sizeof(magic)) {
+            return true;
+        }
+        if (!std::equal(magic, magic + sizeof(magic), buffer_.begin() + begin_)) {
+            failed_ = true;
+            return false;
+        }
+        begin_ += sizeof(magic);
+        handshake_done_ = true;
+    }
+
+    std::vector<std::string> args;
+    while (buffer_.size() - begin_ >= header_length) {
+        const char* frame = buffer_.data() + begin_;
+        auto payload_length = get_u32(frame + 5);
+        if (static_cast<Type>(frame[0]) != Type::request || payload_length > settings::max_frame_length) {
+            failed_ = true;
+            return false;
+        }
+        if (buffer_.size() - begin_ < header_length + payload_length) {
+            // Wait for the rest of payload
+            break;
+        }
+        args.clear();
+        if (!parse_request(frame + header_length, payload_length, args)) {
+            failed_ = true;
+            return false;
+        }
+        begin_ += header_length + payload_length;
+        handler(args);
+    }
+    return true;
+}
+
+#endif // FRAME_PARSER_H
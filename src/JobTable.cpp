@@ -0,0 +1,306 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include <csignal>
+
+#include "settings.h"
+#include "ExecutionScheduler.h"
+#include "WorkerPool.h"
+#include "JobTable.h"
+
+namespace {
+
+const auto tick_period = boost::posix_time::seconds(1);
+
+}
+
+JobTable::Job::Job(JobTable& owner, size_t id, const std::string& name,
+    const std::vector<std::string>& args, const CommandConfig& config)
+    : owner(owner),
+    id(id),
+    name(name),
+    args(args),
+    config(config),
+    state(State::queued),
+    launched(false),
+    status(0),
+    truncation(0),
+    runtime(clock_type::duration::zero()),
+    pid(-1)
+{}
+
+void JobTable::Job::handle_child_exit(pid_t, int status, const rusage& usage) {
+    auto self(shared_from_this());
+    owner.strand_.post([this, self, status, usage]() {
+        pid = -1;
+        if (task) {
+            owner.timing_wheel_.cancel(task->timeout());
+            // Pipes may still hold data, job finishes when they are drained
+            task->handle_exit(status, usage);
+        }
+    });
+}
+
+JobTable::JobTable(boost::asio::io_service& io_service,
+    size_t timeout,
+    dispatcher_type& pid_to_session_map,
+    boost::mutex& signal_mutex,
+    ExecutionScheduler& scheduler,
+    WorkerPool& worker_pool,
+    TimingWheel& timing_wheel)
+
+    : io_service_(io_service),
+    strand_(io_service),
+    timeout_(timeout),
+    last_job_id_(0),
+    tick_timer_(io_service),
+    ticking_(false),
+    pid_to_session_map_(pid_to_session_map),
+    signal_mutex_(signal_mutex),
+    scheduler_(scheduler),
+    worker_pool_(worker_pool),
+    timing_wheel_(timing_wheel),
+    spawner_(settings::use_posix_spawn ? ProcessSpawner::Backend::posix_spawn
+        : ProcessSpawner::Backend::fork_exec)
+{}
+
+size_t JobTable::submit(const std::string& name, const std::vector<std::string>& args,
+    const CommandConfig& config) {
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if (jobs_.size() >= settings::job_table_max_jobs) {
+        return 0;
+    }
+    auto job = std::make_shared<Job>(*this, ++last_job_id_, name, args, config);
+    jobs_[job->id] = job;
+    lock.unlock();
+
+    strand_.post([this, job]() {
+        start(job);
+    });
+    return job->id;
+}
+
+bool JobTable::lookup(size_t job_id, State& state, job_ptr& job) const {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    auto it = jobs_.find(job_id);
+    if (it == jobs_.end()) {
+        return false;
+    }
+    state = it->second->state;
+    job = it->second;
+    return true;
+}
+
+void JobTable::wait(size_t job_id, wait_handler on_finish) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    auto it = jobs_.find(job_id);
+    if (it == jobs_.end()) {
+        lock.unlock();
+        on_finish(job_ptr());
+        return;
+    }
+    if (it->second->state == State::finished) {
+        job_ptr job = it->second;
+        lock.unlock();
+        on_finish(job);
+        return;
+    }
+    waiters_.insert(std::make_pair(job_id, on_finish));
+}
+
+void JobTable::start(const mutable_job_ptr& job) {
+    if (!ticking_) {
+        ticking_ = true;
+        handle_tick();
+    }
+
+    if (!job->stdout_file.open(settings::job_spool_directory)
+        || !job->stderr_file.open(settings::job_spool_directory)) {
+        // Output can't be kept, job is never launched
+        finish(job, false, 0);
+        return;
+    }
+    if (job->config.worker_instances) {
+        submit_to_worker(job);
+        return;
+    }
+    // Request server-wide execution slot
+    scheduler_.acquire(this, job->name, [this, job]() {
+        // Grant can come from any thread
+        strand_.post([this, job]() {
+            launch(job);
+        });
+    });
+}
+
+void JobTable::submit_to_worker(const mutable_job_ptr& job) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        job->state = State::running;
+    }
+    worker_pool_.submit(job->name, job->args, job_timeout(*job).count(),
+        [this, job](WorkerPool::result_ptr result) {
+            strand_.post([this, job, result]() {
+                if (!result) {
+                    // Failed or timed out worker is reported like killed child
+                    finish(job, true, SIGKILL);
+                    return;
+                }
+                job->stdout_file.append(result->stdout_data.data(), result->stdout_data.size());
+                job->stderr_file.append(result->stderr_data.data(), result->stderr_data.size());
+                finish(job, true, result->status);
+            });
+        });
+}
+
+void JobTable::launch(const mutable_job_ptr& job) {
+    int stdout_fd;
+    int stderr_fd;
+    if (spawn(job, stdout_fd, stderr_fd) == -1) {
+        scheduler_.release();
+        finish(job, false, 0);
+        return;
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        job->state = State::running;
+    }
+
+    auto task = std::make_shared<ChildTask>(io_service_, job->id, stdout_fd, stderr_fd);
+    job->task = task;
+
+    arm_timeout(job, job_timeout(*job), settings::kill_grace_period ? SIGTERM : SIGKILL);
+
+    if (job->config.output_limit) {
+        // Spool files are bounded like session output
+        task->set_output_limit(job->config.output_limit, job->config.output_policy, [this, job]() {
+            kill_child(job, SIGKILL);
+        });
+    }
+
+    task->start(strand_,
+        [job](ChildTask::Stream stream, const char* data, size_t length) {
+            auto& file = stream == ChildTask::Stream::output ? job->stdout_file : job->stderr_file;
+            file.append(data, length);
+        },
+        [this, job]() {
+            auto status = job->task->status();
+            job->truncation = job->task->truncation();
+            job->usage = job->task->usage();
+            job->runtime = job->task->exited_at() - job->task->launched_at();
+            scheduler_.record_runtime(job->name, job->runtime);
+            job->task.reset();
+            scheduler_.release();
+            finish(job, true, status);
+        });
+}
+
+std::chrono::seconds JobTable::job_timeout(const Job& job) const {
+    return job.config.timeout ? std::chrono::seconds(job.config.timeout) : timeout_;
+}
+
+void JobTable::arm_timeout(const mutable_job_ptr& job, std::chrono::milliseconds delay, int signal) {
+    job->task->set_timeout(timing_wheel_.schedule(delay, [this, job, signal]() {
+        strand_.post([this, job, signal]() {
+            if (!job->task || !kill_child(job, signal)) {
+                return;
+            }
+            if (signal != SIGKILL) {
+                // Child which ignores SIGTERM is killed after grace period
+                arm_timeout(job, std::chrono::seconds(settings::kill_grace_period), SIGKILL);
+            }
+        });
+    }));
+}
+
+bool JobTable::kill_child(const mutable_job_ptr& job, int signal) {
+    // Reaped child is not registered anymore, its pid may belong to another process
+    boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
+    if (job->pid == -1 || !pid_to_session_map_.count(job->pid)) {
+        return false;
+    }
+    kill(job->pid, signal);
+    return true;
+}
+
+pid_t JobTable::spawn(const mutable_job_ptr& job, int& stdout_fd, int& stderr_fd) {
+    int pipe_stdout[2];
+    int pipe_stderr[2];
+    if (!ProcessSpawner::create_pipe(pipe_stdout)) {
+        return -1;
+    }
+    if (!ProcessSpawner::create_pipe(pipe_stderr)) {
+        close(pipe_stdout[0]);
+        close(pipe_stdout[1]);
+        return -1;
+    }
+
+    // Need to lock because of possible race conditions with SIGCHLD receiving
+    boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
+    auto pid = spawner_.spawn(job->args, pipe_stdout[1], pipe_stderr[1]);
+
+    // Write ends are used only by the child
+    close(pipe_stdout[1]);
+    close(pipe_stderr[1]);
+
+    if (pid < 0) {
+        close(pipe_stdout[0]);
+        close(pipe_stderr[0]);
+        return -1;
+    }
+    job->pid = pid;
+    // Register pid for future SIGCHLD dispatching
+    pid_to_session_map_[pid] = job;
+
+    stdout_fd = pipe_stdout[0];
+    stderr_fd = pipe_stderr[0];
+    return pid;
+}
+
+void JobTable::finish(const mutable_job_ptr& job, bool launched, int status) {
+    job->stdout_file.seal();
+    job->stderr_file.seal();
+    job->launched = launched;
+    job->status = status;
+    job->finished_at = clock_type::now();
+
+    std::vector<wait_handler> handlers;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        // Output is published with the state
+        job->state = State::finished;
+
+        auto range = waiters_.equal_range(job->id);
+        for (auto it = range.first; it != range.second; ++it) {
+            handlers.push_back(it->second);
+        }
+        waiters_.erase(range.first, range.second);
+    }
+    for (auto& handler : handlers) {
+        handler(job);
+    }
+}
+
+void JobTable::handle_tick() {
+    auto expired = clock_type::now() - std::chrono::seconds(settings::job_retention);
+    std::vector<mutable_job_ptr> forgotten;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        for (auto it = jobs_.begin(); it != jobs_.end();) {
+            if (it->second->state == State::finished && it->second->finished_at < expired) {
+                forgotten.push_back(it->second);
+                it = jobs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Spill files are unmapped here, outside of the lock, or by the last session reading them
+
+    tick_timer_.expires_from_now(tick_period);
+    tick_timer_.async_wait(strand_.wrap([this](boost::system::error_code ec) {
+        if (!ec) {
+            handle_tick();
+        }
+    }));
+}
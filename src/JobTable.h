@@ -0,0 +1,157 @@
+#ifndef JOB_TABLE_H
+#define JOB_TABLE_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "types.h"
+#include "BaseSession.h"
+#include "ChildTask.h"
+#include "SpillFile.h"
+#include "ProcessSpawner.h"
+#include "TimingWheel.h"
+
+/*
+    Asynchronous jobs, running independently of the client connection.
+    Output of a job is spooled to spill files, which are mapped to memory
+    when job finishes. Finished jobs are kept for 'settings::job_retention'
+    seconds, so results can be fetched later by any session.
+    Jobs take execution slots like session commands, all jobs compete
+    for them as one scheduler client.
+*/
+class JobTable {
+public: // structs
+
+    enum class State { queued, running, finished };
+
+    typedef std::chrono::steady_clock clock_type;
+
+    /*
+        Submitted command. Fields are changed only from the table strand
+        and are read by sessions only after job is finished.
+    */
+    struct Job : public BaseSession, public std::enable_shared_from_this<Job> {
+        JobTable& owner;
+        size_t id;
+        std::string name;
+        std::vector<std::string> args;
+        CommandConfig config;
+
+        // Guarded by table mutex
+        State state;
+        // False if command could not be launched
+        bool launched;
+        int status;
+        // 'TruncationFlag' bits of output dropped by output limit
+        unsigned truncation;
+        // Resources and runtime of the child, zero for worker jobs
+        ResourceUsage usage;
+        clock_type::duration runtime;
+        clock_type::time_point finished_at;
+
+        SpillFile stdout_file;
+        SpillFile stderr_file;
+
+        // Spawned child, pid is -1 once child is reaped
+        std::shared_ptr<ChildTask> task;
+        pid_t pid;
+
+        Job(JobTable& owner, size_t id, const std::string& name,
+            const std::vector<std::string>& args, const CommandConfig& config);
+
+        virtual void handle_child_exit(pid_t pid, int status, const rusage& usage);
+    };
+
+    typedef std::shared_ptr<const Job> job_ptr;
+
+    /* Called with null job if job is unknown */
+    typedef std::function<void(job_ptr job)> wait_handler;
+
+public: // constructors
+
+    JobTable(boost::asio::io_service& io_service,
+        size_t timeout,
+        dispatcher_type& pid_to_session_map,
+        boost::mutex& signal_mutex,
+        ExecutionScheduler& scheduler,
+        WorkerPool& worker_pool,
+        TimingWheel& timing_wheel);
+
+    /* Noncopyable */
+    JobTable(const JobTable&) = delete;
+    JobTable& operator = (const JobTable&) = delete;
+
+public: // methods
+
+    /*
+        Queues resolved command ('args[0]' is the program) for execution.
+        Returns job id, 0 if table is full.
+    */
+    size_t submit(const std::string& name, const std::vector<std::string>& args,
+        const CommandConfig& config);
+
+    /*
+        Returns false if job is unknown or already forgotten.
+        'job' is set to the job, its output is readable once 'state' is finished.
+    */
+    bool lookup(size_t job_id, State& state, job_ptr& job) const;
+
+    /*
+        Calls 'on_finish' once job is finished, possibly immediately.
+        Handler may be called from any thread and must not block.
+    */
+    void wait(size_t job_id, wait_handler on_finish);
+
+private: // methods
+
+    typedef std::shared_ptr<Job> mutable_job_ptr;
+
+    // Must be called from the strand
+    void start(const mutable_job_ptr& job);
+    void submit_to_worker(const mutable_job_ptr& job);
+    void launch(const mutable_job_ptr& job);
+    std::chrono::seconds job_timeout(const Job& job) const;
+    void arm_timeout(const mutable_job_ptr& job, std::chrono::milliseconds delay, int signal);
+    bool kill_child(const mutable_job_ptr& job, int signal);
+    pid_t spawn(const mutable_job_ptr& job, int& stdout_fd, int& stderr_fd);
+    void finish(const mutable_job_ptr& job, bool launched, int status);
+    void handle_tick();
+
+private: // fields
+
+    boost::asio::io_service& io_service_;
+    boost::asio::io_service::strand strand_;
+
+    // Default child timeout
+    std::chrono::seconds timeout_;
+
+    // Jobs by id
+    std::map<size_t, mutable_job_ptr> jobs_;
+    // Waiters of unfinished jobs by job id
+    std::multimap<size_t, wait_handler> waiters_;
+    size_t last_job_id_;
+    mutable boost::mutex mutex_;
+
+    // Timer for forgetting old finished jobs
+    boost::asio::deadline_timer tick_timer_;
+    bool ticking_;
+
+    // SIGCHLD Dispatching stuff
+    dispatcher_type& pid_to_session_map_;
+    boost::mutex& signal_mutex_;
+
+    ExecutionScheduler& scheduler_;
+    WorkerPool& worker_pool_;
+    TimingWheel& timing_wheel_;
+
+    ProcessSpawner spawner_;
+};
+
+#endif // JOB_TABLE_H
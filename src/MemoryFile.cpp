@@ -0,0 +1,55 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+#include "MemoryFile.h"
+
+MemoryFile::MemoryFile()
+    : fd_(-1)
+{}
+
+MemoryFile::~MemoryFile() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+bool MemoryFile::create(const char* name) {
+    #if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    fd_ = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    return fd_ != -1;
+    #else
+    (void)name;
+    return false;
+    #endif
+}
+
+bool MemoryFile::seal() {
+    #if defined(__linux__) && defined(F_ADD_SEALS)
+    return fcntl(fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+    #else
+    return false;
+    #endif
+}
+
+int MemoryFile::fd() const {
+    return fd_;
+}
+
+size_t MemoryFile::size() const {
+    struct stat st;
+    if (fd_ == -1 || fstat(fd_, &st)) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+size_t MemoryFile::read(size_t offset, char* data, size_t length) const {
+    ssize_t count;
+    do {
+        count = pread(fd_, data, length, offset);
+    } while (count < 0 && errno == EINTR);
+    return count > 0 ? count : 0;
+}
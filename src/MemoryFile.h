@@ -0,0 +1,49 @@
+#ifndef MEMORY_FILE_H
+#define MEMORY_FILE_H
+
+#include <cstddef>
+
+/*
+    Anonymous in-memory file (memfd, Linux only) which child writes its output to.
+    Once sealed, neither its size nor its content can change,
+    so the descriptor can be handed to a client which maps it.
+*/
+class MemoryFile {
+public: // constructors
+
+    MemoryFile();
+
+    ~MemoryFile();
+
+    /* Noncopyable */
+    MemoryFile(const MemoryFile&) = delete;
+    MemoryFile& operator = (const MemoryFile&) = delete;
+
+public: // methods
+
+    /*
+        Creates close-on-exec file, 'name' is seen only in /proc.
+        Returns false on error or if memfd is not supported.
+    */
+    bool create(const char* name);
+
+    /*
+        Forbids writes, growing and shrinking. Returns false on error,
+        e.g. if someone still holds writable shared mapping.
+    */
+    bool seal();
+
+    /* Descriptor owned by the file, -1 if not created */
+    int fd() const;
+
+    size_t size() const;
+
+    /* Reads up to 'length' bytes at 'offset', returns 0 on end of file or error */
+    size_t read(size_t offset, char* data, size_t length) const;
+
+private: // fields
+
+    int fd_;
+};
+
+#endif // MEMORY_FILE_H
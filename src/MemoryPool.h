@@ -0,0 +1,140 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <cstddef>
+#include <new>
+
+#include <boost/thread/mutex.hpp>
+
+#include "settings.h"
+
+/*
+    Process-wide free list of blocks of 'BlockSize' bytes.
+    Freed blocks are kept for reuse up to 'settings::memory_pool_max_free_blocks',
+    so connection churn does not go to the general allocator.
+*/
+template <size_t BlockSize>
+class BlockPool {
+public: // methods
+
+    static BlockPool& instance() {
+        // Never destroyed, blocks can be returned during static destruction
+        static BlockPool* pool = new BlockPool();
+        return *pool;
+    }
+
+    void* allocate() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            if (free_) {
+                auto block = free_;
+                free_ = free_->next;
+                --free_count_;
+                return block;
+            }
+        }
+        return ::operator new(block_size);
+    }
+
+    void deallocate(void* block) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            if (free_count_ < settings::memory_pool_max_free_blocks) {
+                auto free_block = static_cast<FreeBlock*>(block);
+                free_block->next = free_;
+                free_ = free_block;
+                ++free_count_;
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+private: // constructors
+
+    BlockPool() : free_(nullptr), free_count_(0) {}
+
+private: // structs
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static const size_t block_size = BlockSize < sizeof(FreeBlock) ? sizeof(FreeBlock) : BlockSize;
+
+private: // fields
+
+    FreeBlock* free_;
+    size_t free_count_;
+    boost::mutex mutex_;
+};
+
+/*
+    Allocator of single objects from block pools, one pool per object size.
+    Meant for 'std::allocate_shared', so object and its control block
+    are taken from the pool together.
+*/
+template <typename T>
+class PoolAllocator {
+public: // structs
+
+    typedef T value_type;
+
+public: // constructors
+
+    PoolAllocator() {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+public: // methods
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(BlockPool<sizeof(T)>::instance().allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        BlockPool<sizeof(T)>::instance().deallocate(p);
+    }
+
+    template <typename U>
+    bool operator == (const PoolAllocator<U>&) const { return true; }
+
+    template <typename U>
+    bool operator != (const PoolAllocator<U>&) const { return false; }
+};
+
+/* Block of 'Size' bytes taken from the pool for the lifetime of the object */
+template <size_t Size>
+class PooledBuffer {
+public: // constructors
+
+    PooledBuffer() : data_(static_cast<char*>(BlockPool<Size>::instance().allocate())) {}
+
+    ~PooledBuffer() {
+        BlockPool<Size>::instance().deallocate(data_);
+    }
+
+    /* Noncopyable */
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator = (const PooledBuffer&) = delete;
+
+public: // methods
+
+    char* data() { return data_; }
+
+    static size_t size() { return Size; }
+
+private: // fields
+
+    char* data_;
+};
+
+#endif // MEMORY_POOL_H
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <utility>
+
+#include "Metrics.h"
+
+const size_t Metrics::phase_count;
+const size_t Metrics::gauge_count;
+const size_t Metrics::Histogram::sub_bucket_bits;
+const size_t Metrics::Histogram::sub_bucket_count;
+const size_t Metrics::Histogram::bucket_count;
+
+namespace {
+
+/* Per-thread shard of the last used metrics */
+struct CachedShard {
+    const Metrics* owner;
+    void* shard;
+};
+
+thread_local CachedShard cached_shard = {nullptr, nullptr};
+
+const char* phase_names[Metrics::phase_count] = {
+    "parse", "lookup", "spawn", "runtime", "drain", "write"
+};
+
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/* Escapes label value for text format */
+std::string escape(const std::string& value) {
+    std::string escaped;
+    for (auto c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+        }
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+}
+
+Metrics::Histogram::Histogram()
+    : counts_(new std::atomic<uint64_t>[bucket_count]),
+    sum_(0)
+{
+    for (size_t i = 0; i < bucket_count; ++i) {
+        counts_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::Histogram::record(uint64_t value) {
+    // Only owner thread writes, plain load and store are enough
+    auto& count = counts_[bucket(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void Metrics::Histogram::merge_to(std::vector<uint64_t>& counts, uint64_t& sum) const {
+    counts.resize(bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i) {
+        counts[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+    sum += sum_.load(std::memory_order_relaxed);
+}
+
+size_t Metrics::Histogram::bucket(uint64_t value) {
+    if (value < sub_bucket_count) {
+        return value;
+    }
+    // Values with the same highest bit share 'sub_bucket_count' buckets
+    size_t shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+    return sub_bucket_count * (shift + 1) + (value >> shift) - sub_bucket_count;
+}
+
+uint64_t Metrics::Histogram::bucket_value(size_t index) {
+    if (index < sub_bucket_count) {
+        return index;
+    }
+    size_t shift = index / sub_bucket_count - 1;
+    uint64_t lower = static_cast<uint64_t>(index % sub_bucket_count + sub_bucket_count) << shift;
+    return lower + (uint64_t(1) << shift) / 2;
+}
+
+Metrics::UsageTotals::UsageTotals() {
+    for (auto total : {&runs, &user_us, &system_us, &max_rss_kb, &voluntary_switches,
+        &involuntary_switches, &input_blocks, &output_blocks}) {
+        total->store(0, std::memory_order_relaxed);
+    }
+}
+
+Metrics::Metrics() {
+    for (auto& gauge : gauges_) {
+        gauge.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::record(Phase phase, const std::string& command, clock_type::duration duration) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    histogram(phase, command).record(ns > 0 ? ns : 0);
+}
+
+void Metrics::record_since(Phase phase, const std::string& command, clock_type::time_point start) {
+    record(phase, command, clock_type::now() - start);
+}
+
+void Metrics::add(Gauge gauge, int64_t delta) {
+    gauges_[static_cast<size_t>(gauge)].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void Metrics::record_usage(const std::string& command, const ResourceUsage& usage) {
+    auto& shard = local_shard();
+    auto it = shard.usage.find(command);
+    if (it == shard.usage.end()) {
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        it = shard.usage.emplace(std::piecewise_construct,
+            std::forward_as_tuple(command), std::forward_as_tuple()).first;
+    }
+    auto& totals = it->second;
+    // Only owner thread writes, plain load and store are enough
+    auto add = [](std::atomic<uint64_t>& total, uint64_t value) {
+        total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    };
+    add(totals.runs, 1);
+    add(totals.user_us, usage.user_us);
+    add(totals.system_us, usage.system_us);
+    add(totals.voluntary_switches, usage.voluntary_switches);
+    add(totals.involuntary_switches, usage.involuntary_switches);
+    add(totals.input_blocks, usage.input_blocks);
+    add(totals.output_blocks, usage.output_blocks);
+    if (usage.max_rss_kb > totals.max_rss_kb.load(std::memory_order_relaxed)) {
+        totals.max_rss_kb.store(usage.max_rss_kb, std::memory_order_relaxed);
+    }
+}
+
+Metrics::Shard& Metrics::local_shard() {
+    auto& cached = cached_shard;
+    if (cached.owner != this) {
+        // First record of this thread, shard lives as long as metrics
+        std::unique_ptr<Shard> shard(new Shard());
+        cached.shard = shard.get();
+        cached.owner = this;
+
+        boost::unique_lock<boost::mutex> lock(shards_mutex_);
+        shards_.push_back(std::move(shard));
+    }
+    return *static_cast<Shard*>(cached.shard);
+}
+
+Metrics::Histogram& Metrics::histogram(Phase phase, const std::string& command) {
+    auto& shard = local_shard();
+    // Only owner thread changes the map, so it can look up without lock
+    auto it = shard.commands.find(command);
+    if (it == shard.commands.end()) {
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        it = shard.commands.emplace(std::piecewise_construct,
+            std::forward_as_tuple(command), std::forward_as_tuple(phase_count)).first;
+    }
+    return it->second[static_cast<size_t>(phase)];
+}
+
+void Metrics::render(std::ostream& out) const {
+    struct Merged {
+        std::vector<uint64_t> counts;
+        uint64_t sum;
+    };
+    /* Usage totals of all shards */
+    struct MergedUsage {
+        uint64_t runs;
+        uint64_t user_us;
+        uint64_t system_us;
+        uint64_t max_rss_kb;
+        uint64_t voluntary_switches;
+        uint64_t involuntary_switches;
+        uint64_t input_blocks;
+        uint64_t output_blocks;
+    };
+    // Sorted by phase, then command
+    std::map<std::pair<size_t, std::string>, Merged> merged;
+    // Sorted by command
+    std::map<std::string, MergedUsage> merged_usage;
+    {
+        boost::unique_lock<boost::mutex> lock(shards_mutex_);
+        for (auto& shard : shards_) {
+            boost::unique_lock<boost::mutex> shard_lock(shard->mutex);
+            for (auto& command : shard->commands) {
+                for (size_t phase = 0; phase < phase_count; ++phase) {
+                    auto& entry = merged[std::make_pair(phase, command.first)];
+                    command.second[phase].merge_to(entry.counts, entry.sum);
+                }
+            }
+            for (auto& command : shard->usage) {
+                auto& totals = command.second;
+                auto& entry = merged_usage.insert(std::make_pair(command.first, MergedUsage())).first->second;
+                entry.runs += totals.runs.load(std::memory_order_relaxed);
+                entry.user_us += totals.user_us.load(std::memory_order_relaxed);
+                entry.system_us += totals.system_us.load(std::memory_order_relaxed);
+                entry.max_rss_kb = std::max<uint64_t>(entry.max_rss_kb, totals.max_rss_kb.load(std::memory_order_relaxed));
+                entry.voluntary_switches += totals.voluntary_switches.load(std::memory_order_relaxed);
+                entry.involuntary_switches += totals.involuntary_switches.load(std::memory_order_relaxed);
+                entry.input_blocks += totals.input_blocks.load(std::memory_order_relaxed);
+                entry.output_blocks += totals.output_blocks.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    out << "# HELP remote_runnerd_phase_seconds Duration of request phases.\n"
+        << "# TYPE remote_runnerd_phase_seconds summary\n";
+    for (auto& entry : merged) {
+        auto& counts = entry.second.counts;
+        uint64_t total = 0;
+        for (auto count : counts) {
+            total += count;
+        }
+        if (!total) {
+            continue;
+        }
+
+        std::string labels = std::string("phase=\"") + phase_names[entry.first.first] + "\"";
+        if (!entry.first.second.empty()) {
+            labels += ",command=\"" + escape(entry.first.second) + "\"";
+        }
+
+        for (auto quantile : quantiles) {
+            // Rank of the quantile value, counted from 1
+            uint64_t rank = static_cast<uint64_t>(quantile * total);
+            rank = rank ? rank : 1;
+            uint64_t seen = 0;
+            size_t index = 0;
+            while (index < counts.size() && (seen += counts[index]) < rank) {
+                ++index;
+            }
+            out << "remote_runnerd_phase_seconds{" << labels << ",quantile=\"" << quantile << "\"} "
+                << Histogram::bucket_value(index) / 1e9 << "\n";
+        }
+        out << "remote_runnerd_phase_seconds_sum{" << labels << "} " << entry.second.sum / 1e9 << "\n"
+            << "remote_runnerd_phase_seconds_count{" << labels << "} " << total << "\n";
+    }
+
+    out << "# HELP remote_runnerd_command_runs_total Finished children of commands.\n"
+        << "# TYPE remote_runnerd_command_runs_total counter\n";
+    for (auto& entry : merged_usage) {
+        out << "remote_runnerd_command_runs_total{command=\"" << escape(entry.first) << "\"} "
+            << entry.second.runs << "\n";
+    }
+    out << "# HELP remote_runnerd_command_cpu_seconds_total CPU time of command children.\n"
+        << "# TYPE remote_runnerd_command_cpu_seconds_total counter\n";
+    for (auto& entry : merged_usage) {
+        auto labels = "command=\"" + escape(entry.first) + "\"";
+        out << "remote_runnerd_command_cpu_seconds_total{" << labels << ",mode=\"user\"} "
+            << entry.second.user_us / 1e6 << "\n"
+            << "remote_runnerd_command_cpu_seconds_total{" << labels << ",mode=\"system\"} "
+            << entry.second.system_us / 1e6 << "\n";
+    }
+    out << "# HELP remote_runnerd_command_max_rss_bytes Largest resident set of a command child.\n"
+        << "# TYPE remote_runnerd_command_max_rss_bytes gauge\n";
+    for (auto& entry : merged_usage) {
+        out << "remote_runnerd_command_max_rss_bytes{command=\"" << escape(entry.first) << "\"} "
+            << entry.second.max_rss_kb * 1024 << "\n";
+    }
+    out << "# HELP remote_runnerd_command_context_switches_total Context switches of command children.\n"
+        << "# TYPE remote_runnerd_command_context_switches_total counter\n";
+    for (auto& entry : merged_usage) {
+        auto labels = "command=\"" + escape(entry.first) + "\"";
+        out << "remote_runnerd_command_context_switches_total{" << labels << ",kind=\"voluntary\"} "
+            << entry.second.voluntary_switches << "\n"
+            << "remote_runnerd_command_context_switches_total{" << labels << ",kind=\"involuntary\"} "
+            << entry.second.involuntary_switches << "\n";
+    }
+    out << "# HELP remote_runnerd_command_block_operations_total Block I/O operations of command children.\n"
+        << "# TYPE remote_runnerd_command_block_operations_total counter\n";
+    for (auto& entry : merged_usage) {
+        auto labels = "command=\"" + escape(entry.first) + "\"";
+        out << "remote_runnerd_command_block_operations_total{" << labels << ",direction=\"input\"} "
+            << entry.second.input_blocks << "\n"
+            << "remote_runnerd_command_block_operations_total{" << labels << ",direction=\"output\"} "
+            << entry.second.output_blocks << "\n";
+    }
+
+    out << "# HELP remote_runnerd_sessions Open client sessions.\n"
+        << "# TYPE remote_runnerd_sessions gauge\n"
+        << "remote_runnerd_sessions " << gauges_[static_cast<size_t>(Gauge::sessions)] << "\n"
+        << "# HELP remote_runnerd_queued_commands Parsed commands waiting in session queues.\n"
+        << "# TYPE remote_runnerd_queued_commands gauge\n"
+        << "remote_runnerd_queued_commands " << gauges_[static_cast<size_t>(Gauge::queued_commands)] << "\n"
+        << "# HELP remote_runnerd_buffered_output_bytes Output bytes waiting to be written to clients.\n"
+        << "# TYPE remote_runnerd_buffered_output_bytes gauge\n"
+        << "remote_runnerd_buffered_output_bytes " << gauges_[static_cast<size_t>(Gauge::buffered_bytes)] << "\n";
+}
@@ -0,0 +1,158 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "types.h"
+
+/*
+    Latency histograms of request phases, resource usage totals of commands
+    and server-wide gauges.
+    Every thread records into its own shard, so recording takes no lock
+    and does no atomic read-modify-write. Shards are merged on render.
+*/
+class Metrics {
+public: // structs
+
+    typedef std::chrono::steady_clock clock_type;
+
+    enum class Phase {
+        // Parsing of received data into commands
+        parse,
+        // Config lookup of the command
+        lookup,
+        // Pipes creation and child spawn
+        spawn,
+        // From spawn to child exit
+        runtime,
+        // From child exit to drained output pipes
+        drain,
+        // From enqueueing to completion of socket write
+        write
+    };
+
+    enum class Gauge {
+        sessions,
+        // Parsed commands waiting in session queues
+        queued_commands,
+        // Output bytes waiting in session write queues
+        buffered_bytes
+    };
+
+    static const size_t phase_count = 6;
+    static const size_t gauge_count = 3;
+
+    /*
+        Log-linear histogram of nanosecond values with 1/8 relative precision.
+        Written only by the owner thread, may be read concurrently.
+    */
+    class Histogram {
+    public: // constructors
+
+        Histogram();
+
+    public: // methods
+
+        void record(uint64_t value);
+
+        /* Adds bucket counts to 'counts' and sum of values to 'sum' */
+        void merge_to(std::vector<uint64_t>& counts, uint64_t& sum) const;
+
+        static size_t bucket(uint64_t value);
+        /* Returns middle value of the bucket */
+        static uint64_t bucket_value(size_t index);
+
+    public: // constants
+
+        static const size_t sub_bucket_bits = 3;
+        static const size_t sub_bucket_count = 1 << sub_bucket_bits;
+        static const size_t bucket_count = sub_bucket_count * (65 - sub_bucket_bits);
+
+    private: // fields
+
+        std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+        std::atomic<uint64_t> sum_;
+    };
+
+public: // constructors
+
+    Metrics();
+
+    /* Noncopyable */
+    Metrics(const Metrics&) = delete;
+    Metrics& operator = (const Metrics&) = delete;
+
+public: // methods
+
+    /*
+        Records duration of 'phase' of 'command'.
+        Empty 'command' means that phase is not related to one command.
+    */
+    void record(Phase phase, const std::string& command, clock_type::duration duration);
+
+    /*
+        Records duration from 'start' till now.
+    */
+    void record_since(Phase phase, const std::string& command, clock_type::time_point start);
+
+    void add(Gauge gauge, int64_t delta);
+
+    /*
+        Adds resources used by children of one run of 'command'.
+    */
+    void record_usage(const std::string& command, const ResourceUsage& usage);
+
+    /*
+        Writes histograms as summaries and gauges in Prometheus text format.
+    */
+    void render(std::ostream& out) const;
+
+private: // structs
+
+    typedef std::vector<Histogram> phase_histograms;
+
+    /* Usage totals of one command, written only by the owner thread */
+    struct UsageTotals {
+        std::atomic<uint64_t> runs;
+        std::atomic<uint64_t> user_us;
+        std::atomic<uint64_t> system_us;
+        std::atomic<uint64_t> max_rss_kb;
+        std::atomic<uint64_t> voluntary_switches;
+        std::atomic<uint64_t> involuntary_switches;
+        std::atomic<uint64_t> input_blocks;
+        std::atomic<uint64_t> output_blocks;
+
+        UsageTotals();
+    };
+
+    /* Histograms and usage totals of one thread by command */
+    struct Shard {
+        std::unordered_map<std::string, phase_histograms> commands;
+        std::unordered_map<std::string, UsageTotals> usage;
+        // Taken by owner only when adding command, and by render
+        mutable boost::mutex mutex;
+    };
+
+private: // methods
+
+    Shard& local_shard();
+    Histogram& histogram(Phase phase, const std::string& command);
+
+private: // fields
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    mutable boost::mutex shards_mutex_;
+
+    std::atomic<int64_t> gauges_[gauge_count];
+};
+
+#endif // METRICS_H
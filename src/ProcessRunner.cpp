@@ -1,50 +1,71 @@
 #include <sys/wait.h>
 #include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <algorithm>
+#include <limits>
 
-#include <boost/algorithm/string.hpp>
 #include <boost/tokenizer.hpp>
 
 #include "ProcessRunner.h"
 
+namespace {
+
+// Commands of batches get task ids which requests never reach
+const size_t first_batch_item_id = std::numeric_limits<size_t>::max() / 2 + 1;
+
+}
+
 ProcessRunner::ProcessRunner(const SyncData& sync_data)
-    : config_(sync_data.config),
-    config_mutex_(sync_data.config_mutex),
+    : protocol_(Protocol::unknown),
+    last_request_id_(0),
+    last_batch_item_id_(first_batch_item_id - 1),
+    config_store_(sync_data.config_store),
+    metrics_(sync_data.metrics),
     pid_to_session_map_(sync_data.pid_to_session_map),
     signal_mutex_(sync_data.signal_mutex),
-    is_running_(false), 
-    pid_(-1),
-    task_id_(0),
-    stdout_(nullptr),
-    stderr_(nullptr)
+    spawner_(settings::use_posix_spawn ? ProcessSpawner::Backend::posix_spawn
+        : ProcessSpawner::Backend::fork_exec)
 {}
 
-void ProcessRunner::commit_data(const std::string& data) {
-    data_ += data;
-    size_t pos = data_.find_first_of('\n');
-    if (pos != std::string::npos) {
-        // Extract command from buffer
-        auto cmd = data_.substr(0, pos);
+ProcessRunner::~ProcessRunner() {
+    // Commands of closed session are never launched
+    metrics_.add(Metrics::Gauge::queued_commands, -static_cast<int64_t>(cmd_queue_.size()));
+}
 
-        // Command can't consist only of whitespace symbols
-        boost::algorithm::trim(cmd);
+bool ProcessRunner::commit_data(const char* data, size_t length) {
+    auto start = Metrics::clock_type::now();
+    boost::unique_lock<boost::mutex> lock(queue_mutex_);
+    if (protocol_ == Protocol::unknown && length) {
+        // Text command can't start with NUL, binary magic does
+        protocol_ = data[0] == FrameParser::magic[0] ? Protocol::binary : Protocol::text;
+    }
+    auto queued = cmd_queue_.size();
+    bool parsed = true;
+    if (protocol_ == Protocol::binary) {
+        parsed = frame_parser_.parse(data, length, [this](std::vector<std::string>& args) {
+            cmd_queue_.push(QueuedCommand{++last_request_id_, std::string(), std::move(args)});
+        });
+    } else {
+        parser_.parse(data, length, [this](const std::string& cmd) {
+            cmd_queue_.push(QueuedCommand{++last_request_id_, cmd, std::vector<std::string>()});
+        });
+    }
+    metrics_.add(Metrics::Gauge::queued_commands, cmd_queue_.size() - queued);
+    lock.unlock();
 
-        // Erase current command from data buffer
-        data_.erase(0, pos + 1);
+    metrics_.record_since(Metrics::Phase::parse, std::string(), start);
+    return parsed;
+}
 
-        if (cmd.empty()) {
-            // Ignore empty commands
-            return;
-        }
-        
-        boost::unique_lock<boost::mutex> lock(queue_mutex_);
-        cmd_queue_.push(cmd);
-    }
+ProcessRunner::Protocol ProcessRunner::protocol() const {
+    boost::unique_lock<boost::mutex> lock(queue_mutex_);
+    return protocol_;
 }
 
-std::vector<std::string> ProcessRunner::tokenize_cmd(const std::string& cmd) const {
-    boost::char_separator<char> sep(" \t");
+std::vector<std::string> ProcessRunner::tokenize_cmd(const std::string& cmd, const char* kept_separators) const {
+    // Pipe sign splits pipeline stages even without spaces around it
+    boost::char_separator<char> sep(" \t", kept_separators);
     boost::tokenizer<boost::char_separator<char>> tokenizer(cmd, sep);
 
     std::vector<std::string> args;
@@ -61,174 +82,348 @@ std::vector<std::string> ProcessRunner::tokenize_cmd(const std::string& cmd) con
 }
 
 // pair.first = true if command was found
-std::pair<bool, std::string> ProcessRunner::search_cmd(const std::string& cmd) {
-    // Reader lock
-    boost::shared_lock<boost::shared_mutex> lock(config_mutex_);
-
-    // Search for match
-    auto found = config_.find(cmd) != config_.end();
-    return found ? std::make_pair(true, config_.at(cmd)) : std::make_pair(false, "");
+std::pair<bool, CommandConfig> ProcessRunner::search_cmd(const std::string& cmd) {
+    auto start = Metrics::clock_type::now();
+    // Snapshot is immutable, no locking needed
+    auto config = config_store_.current().find(cmd);
+    if (!config) {
+        return std::make_pair(false, CommandConfig());
+    }
+    // Only allowed commands are recorded, so clients can't blow up metrics
+    metrics_.record_since(Metrics::Phase::lookup, cmd, start);
+    return std::make_pair(true, *config);
 }
 
-ProcessRunner::AttemptStatus ProcessRunner::attempt_launch() {
+bool ProcessRunner::next_command(ResolvedCommand& command) {
     boost::unique_lock<boost::mutex> queue_lock(queue_mutex_);
-    boost::unique_lock<boost::mutex> child_lock(child_mutex_);
-    if (is_running_ || cmd_queue_.empty()) {
-        // Child is already running or nothing to execute
-        return AttemptStatus(false, false, task_id_);
+    if (cmd_queue_.empty()) {
+        // Nothing to execute
+        return false;
     }
-    
-    auto cmd = cmd_queue_.front();
+    auto queued = std::move(cmd_queue_.front());
     cmd_queue_.pop();
     queue_lock.unlock();
-    // Checking command
-    auto args = tokenize_cmd(cmd);        
-    if (args.empty()) {
-        // Command is invalid
-        return AttemptStatus(true, false, task_id_);
+    metrics_.add(Metrics::Gauge::queued_commands, -1);
+
+    // Checking command, binary requests are not re-tokenized
+    command.id = queued.id;
+    bool text = queued.args.empty();
+    command.args = text ? tokenize_cmd(queued.line) : std::move(queued.args);
+    if (text && command.args[0] == "batch") {
+        // Batch separator splits commands even without spaces around it
+        command.args = tokenize_cmd(queued.line, "|;");
+    }
+    command.valid = false;
+    bool verb_valid = false;
+    command.verb = parse_verb(command.args, command.job_id, verb_valid);
+    if (command.verb == Verb::batch) {
+        command.valid = resolve_batch(command);
+        return true;
+    }
+    if (command.verb != Verb::run && command.verb != Verb::submit) {
+        // Job operations are not looked up in config
+        command.valid = verb_valid;
+        return true;
     }
-    auto search_result = search_cmd(args[0]);
+    command.valid = resolve_command(command);
+    return true;
+}
+
+// Looks up program of run or submit command, returns false if it is not allowed
+bool ProcessRunner::resolve_command(ResolvedCommand& command) {
+    if (command.args.empty()) {
+        return false;
+    }
+    auto search_result = search_cmd(command.args[0]);
     if (!search_result.first) {
-        return AttemptStatus(true, false, task_id_);
+        return false;
+    }
+    command.config = search_result.second;
+    command.name = command.args[0];
+    command.args[0] = command.config.program;
+    return resolve_pipeline(command);
+}
+
+// Splits batch arguments into commands, returns false if batch is malformed
+bool ProcessRunner::resolve_batch(ResolvedCommand& command) {
+    auto begin = command.args.begin();
+    if (begin != command.args.end() && *begin == "--completion-order") {
+        command.completion_order = true;
+        ++begin;
+    }
+    std::vector<std::vector<std::string>> items(1);
+    for (auto it = begin; it != command.args.end(); ++it) {
+        if (*it == ";") {
+            items.emplace_back();
+        } else {
+            items.back().push_back(std::move(*it));
+        }
+    }
+    command.args.clear();
+
+    if (items.size() > settings::max_batch_commands) {
+        return false;
+    }
+    for (auto& args : items) {
+        if (args.empty()) {
+            return false;
+        }
+    }
+    for (auto& args : items) {
+        ResolvedCommand item;
+        item.id = ++last_batch_item_id_;
+        item.args = std::move(args);
+        // Only commands run by session can be batched
+        bool verb_valid = false;
+        item.verb = parse_verb(item.args, item.job_id, verb_valid);
+        item.valid = item.verb == Verb::run && resolve_command(item);
+        command.batch.push_back(std::move(item));
+    }
+    return true;
+}
+
+// Splits stages after the first one to 'piped_args', returns false if pipeline is not allowed
+bool ProcessRunner::resolve_pipeline(ResolvedCommand& command) {
+    auto separator = std::find(command.args.begin(), command.args.end(), "|");
+    if (separator == command.args.end()) {
+        // Plain command
+        return true;
+    }
+    std::vector<std::string> stage;
+    for (auto it = separator + 1; it != command.args.end(); ++it) {
+        if (*it == "|") {
+            command.piped_args.push_back(std::move(stage));
+            stage.clear();
+        } else {
+            stage.push_back(std::move(*it));
+        }
+    }
+    command.piped_args.push_back(std::move(stage));
+    command.args.erase(separator, command.args.end());
+
+    if (command.verb != Verb::run || command.config.worker_instances
+        || command.piped_args.size() + 1 > settings::max_pipeline_stages) {
+        return false;
+    }
+    for (auto& stage_args : command.piped_args) {
+        if (stage_args.empty()) {
+            return false;
+        }
+        auto search_result = search_cmd(stage_args[0]);
+        auto& config = search_result.second;
+        if (!search_result.first || config.worker_instances) {
+            return false;
+        }
+        stage_args[0] = config.program;
+        if (config.timeout && (!command.config.timeout || config.timeout < command.config.timeout)) {
+            command.config.timeout = config.timeout;
+        }
+        // Only the last stage output reaches the client
+        command.config.output_limit = config.output_limit;
+        command.config.output_policy = config.output_policy;
+    }
+    // Pipeline results are not cached
+    command.config.cache_ttl = 0;
+    return true;
+}
+
+// Strips verb from 'args', 'valid' is set for job operations only
+ProcessRunner::Verb ProcessRunner::parse_verb(std::vector<std::string>& args,
+    size_t& job_id, bool& valid) const {
+
+    static const std::map<std::string, Verb> verbs = {
+        {"submit", Verb::submit}, {"status", Verb::status}, {"wait", Verb::wait}, {"fetch", Verb::fetch},
+        {"capability", Verb::capability}, {"batch", Verb::batch}
+    };
+    auto it = verbs.find(args[0]);
+    if (it == verbs.end()) {
+        return Verb::run;
+    }
+    args.erase(args.begin());
+    if (it->second == Verb::submit || it->second == Verb::batch) {
+        return it->second;
+    }
+
+    valid = false;
+    if (it->second == Verb::capability) {
+        valid = args.size() == 1;
+        return Verb::capability;
+    }
+    if (args.size() == 1 && !args[0].empty() && args[0].find_first_not_of("0123456789") == std::string::npos) {
+        job_id = std::strtoull(args[0].c_str(), nullptr, 10);
+        valid = job_id != 0;
+    }
+    return it->second;
+}
+
+ProcessRunner::AttemptStatus ProcessRunner::attempt_launch(const ResolvedCommand& command,
+    int stdout_target, int stderr_target) {
+
+    auto task_id = command.id;
+    if (!command.valid) {
+        return AttemptStatus(true, false, task_id);
+    }
+
+    auto session = session_.lock();
+    if (!session) {
+        // Session is being destroyed
+        return AttemptStatus(true, false, task_id);
     }
-    auto program = search_result.second;
-    args[0] = program;
     
+    boost::unique_lock<boost::mutex> child_lock(child_mutex_);
     // Need to lock because of possible race conditions with SIGCHLD receiving
     boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
-    // Create pipe, fork, exec and acquire child's stdout file struct pointer 
-    auto pid = exec_and_bind_streams(args);
+    // Create pipes, spawn child and acquire read ends of its stdout and stderr
+    int stdout_fd;
+    int stderr_fd;
+    RunningTask task;
+    auto start = Metrics::clock_type::now();
+    task.pid = exec_and_bind_streams(command, task.piped_pids, stdout_target, stderr_target,
+        stdout_fd, stderr_fd);
+    metrics_.record_since(Metrics::Phase::spawn, command.name, start);
 
-    if (pid == -1) {
+    if (task.pid == -1) {
         // Launch failed
-        return AttemptStatus(true, false, task_id_);
+        return AttemptStatus(true, false, task_id);
     }
 
     // Launch is successful
+    // Register pids for future SIGCHLD dispatching
+    pid_to_session_map_[task.pid] = session;
+    for (auto pid : task.piped_pids) {
+        pid_to_session_map_[pid] = session;
+    }
     // Create execution context
-    is_running_ = true;
-    pid_ = pid;
-    // Register pid for future SIGCHLD dispatching
-    pid_to_session_map_[pid] = session_;
-    return AttemptStatus(true, true, task_id_);
-}
-
-void ProcessRunner::set_parent_descriptors(int pipe_stdout[2], int pipe_stderr[2]) {
-    close(pipe_stdout[1]);
-    close(pipe_stderr[1]);
-    stdout_ = fdopen(pipe_stdout[0], "r");
-    stderr_ = fdopen(pipe_stderr[0], "r");
-}
-
-void ProcessRunner::set_child_descriptors(int pipe_stdout[2], int pipe_stderr[2]) {
-    close(pipe_stdout[0]);
-    close(pipe_stderr[0]);
-    dup2(pipe_stdout[1], STDOUT_FILENO);
-    dup2(pipe_stderr[1], STDERR_FILENO);
-    close(pipe_stdout[1]);
-    close(pipe_stderr[1]);
+    running_tasks_[task_id] = std::move(task);
+    return AttemptStatus(true, true, task_id, stdout_fd, stderr_fd);
 }
 
 // Must be synchronized
-pid_t ProcessRunner::exec_and_bind_streams(const std::vector<std::string>& args) {
-    // Creating pipe
-    const char* program = args[0].c_str();
-    int pipe_stdout[2];
-    int pipe_stderr[2];
-    if (pipe(pipe_stdout) || pipe(pipe_stderr)) {
+pid_t ProcessRunner::exec_and_bind_streams(const ResolvedCommand& command, std::vector<pid_t>& piped_pids,
+    int stdout_target, int stderr_target, int& stdout_fd, int& stderr_fd) {
+
+    // All stages share stderr pipe or target
+    int pipe_stderr[2] = {-1, stderr_target};
+    if (stderr_target == -1 && !ProcessSpawner::create_pipe(pipe_stderr)) {
         // Pipe error occured
         return -1;
     }
 
-    auto pid = fork();
+    // Stage stdout is read by the next stage, last one by the daemon or written to target
+    pid_t pid = -1;
+    int input_fd = -1;
+    bool failed = false;
+    for (size_t stage = 0; stage <= command.piped_args.size(); ++stage) {
+        bool last = stage == command.piped_args.size();
+        int pipe_stdout[2] = {-1, stdout_target};
+        if ((!last || stdout_target == -1) && !ProcessSpawner::create_pipe(pipe_stdout)) {
+            failed = true;
+            break;
+        }
+        auto& args = stage ? command.piped_args[stage - 1] : command.args;
+        auto stage_pid = spawner_.spawn(args, pipe_stdout[1], pipe_stderr[1], input_fd);
 
-    if (pid < 0) {
-        // Fork error occured
-        return -1;
-    }
+        // Pipe ends are used only by the children
+        if (pipe_stdout[0] != -1) {
+            close(pipe_stdout[1]);
+        }
+        if (input_fd != -1) {
+            close(input_fd);
+        }
+        input_fd = pipe_stdout[0];
 
-    if (pid != 0) {
-        set_parent_descriptors(pipe_stdout, pipe_stderr);
-        return pid;
-    } else {
-        // Need to unlock captured mutexes 
-        child_mutex_.unlock();
-        signal_mutex_.unlock();
-        // We are in the child
-        set_child_descriptors(pipe_stdout, pipe_stderr);
-        // Copy argv for new process executing
-        char** argv = create_argv(args);
+        if (stage_pid < 0) {
+            // Spawn error occured
+            failed = true;
+            break;
+        }
+        if (stage) {
+            piped_pids.push_back(stage_pid);
+        } else {
+            pid = stage_pid;
+        }
+    }
+    if (pipe_stderr[0] != -1) {
+        close(pipe_stderr[1]);
+    }
 
-        execv(program, argv);
-        perror("child");
-        exit(1);
+    if (failed) {
+        // Spawned stages are not registered, server reaps them as unknown children
+        if (pid != -1) {
+            kill(pid, SIGKILL);
+        }
+        for (auto stage_pid : piped_pids) {
+            kill(stage_pid, SIGKILL);
+        }
+        piped_pids.clear();
+        if (input_fd != -1) {
+            close(input_fd);
+        }
+        if (pipe_stderr[0] != -1) {
+            close(pipe_stderr[0]);
+        }
+        return -1;
     }
-    // return -1;
+
+    stdout_fd = input_fd;
+    stderr_fd = pipe_stderr[0];
+    return pid;
 }
 
-char** ProcessRunner::create_argv(const std::vector<std::string>& args) const {
-    char** argv = new char*[args.size() + 1];
-    for (size_t i = 0; i < args.size(); ++i) {
-        argv[i] = new char[args[i].length() + 1];
-        strcpy(argv[i], args[i].c_str());
+size_t ProcessRunner::release_child(pid_t pid, size_t& stage) {
+    boost::unique_lock<boost::mutex> lock(child_mutex_);
+    for (auto& task : running_tasks_) {
+        if (task.second.pid == pid) {
+            task.second.pid = -1;
+            stage = 0;
+            return task.first;
+        }
+        auto& piped = task.second.piped_pids;
+        auto it = std::find(piped.begin(), piped.end(), pid);
+        if (it != piped.end()) {
+            *it = -1;
+            stage = it - piped.begin() + 1;
+            return task.first;
+        }
     }
-    // Arguments must be guarded by NULL
-    argv[args.size()] = nullptr;
-    return argv;
+    return 0;
 }
 
-int ProcessRunner::write_execution_result(buffer_type& stdout_buf, buffer_type& stderr_buf) {
+void ProcessRunner::complete_task(size_t id) {
     boost::unique_lock<boost::mutex> lock(child_mutex_);
-    if (pid_ == -1) return 1;
-
-    int status;
-    // Obtain child exit code 
-    waitpid(pid_, &status, 0);
-
-    // Copy file struct pointers
-    FILE* stdout = stdout_;
-    FILE* stderr = stderr_;
-    // Clear context for the next launch
-    clear_context();     
     // Ready for new task!
-    ++task_id_;
-    lock.unlock();
-
-    if (stdout && stderr) {
-        // Now we can read child's stdout and stderr
-        read_file_to_buf(stdout_buf, stdout);
-        read_file_to_buf(stderr_buf, stderr);
-        
-        fclose(stdout);
-        fclose(stderr);
-    }
-    return status;
+    running_tasks_.erase(id);
 }
 
-// Must be synchronized
-void ProcessRunner::clear_context() {
-    is_running_ = false;
-    stdout_ = 0;
-    stderr_ = 0;
-    pid_ = -1;
-}
+void ProcessRunner::kill_task(size_t id, int signal) {
+    boost::unique_lock<boost::mutex> lock(child_mutex_);
+    // Need to lock because child can be reaped concurrently
+    boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
 
-void ProcessRunner::read_file_to_buf(buffer_type& result, FILE* file) {
-    while (!feof(file)) {
-        int bytes_read;
-        if ((bytes_read = fread(buf_, sizeof(char), buffer_length, file)) != 0) {
-            for (size_t i = 0; i < bytes_read; ++i) {
-                result.push_back(buf_[i]);
-            }
+    auto it = running_tasks_.find(id);
+    if (it == running_tasks_.end()) {
+        return;
+    }
+    // Reaped child is not registered anymore, its pid may belong to another process
+    auto pid = it->second.pid;
+    if (pid != -1 && pid_to_session_map_.count(pid)) {
+        kill(pid, signal);
+    }
+    for (auto piped_pid : it->second.piped_pids) {
+        if (piped_pid != -1 && pid_to_session_map_.count(piped_pid)) {
+            kill(piped_pid, signal);
         }
     }
 }
 
-void ProcessRunner::kill_task(size_t id) {
+size_t ProcessRunner::queued_commands() {
+    boost::unique_lock<boost::mutex> lock(queue_mutex_);
+    return cmd_queue_.size();
+}
+
+size_t ProcessRunner::running_tasks() {
     boost::unique_lock<boost::mutex> lock(child_mutex_);
-    if (id == task_id_ && pid_ != -1) {
-        kill(pid_, SIGKILL);
-    }
+    return running_tasks_.size();
 }
 
 void ProcessRunner::initialize_with_session(const std::shared_ptr<BaseSession>& session) {
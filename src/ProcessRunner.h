@@ -4,6 +4,8 @@
 #include <memory>
 #include <vector>
 #include <queue>
+#include <list>
+#include <map>
 #include <string>
 #include <utility>
 
@@ -12,22 +14,69 @@
 
 #include "settings.h"
 #include "types.h"
+#include "ProcessSpawner.h"
+#include "ConfigStore.h"
+#include "Metrics.h"
+#include "CommandParser.h"
+#include "FrameParser.h"
 
 class ProcessRunner {
 public: // constructors
 
     ProcessRunner(const SyncData& sync_data);
 
+    ~ProcessRunner();
+
 public: // structs
 
+    /* Wire format of the session, chosen by the first received byte */
+    enum class Protocol { unknown, text, binary };
+
+    /* What is requested: command run by session, an asynchronous job operation,
+       enabling of session capability or a batch of commands */
+    enum class Verb { run, submit, status, wait, fetch, capability, batch };
+
+    /* Parsed command with resolved program */
+    struct ResolvedCommand {
+        // Request id
+        size_t id;
+        Verb verb;
+        // Job of 'status', 'wait' and 'fetch' verbs
+        size_t job_id;
+        // Capability name of 'capability' verb is 'args[0]'
+        // False if command is not allowed by config or verb is malformed
+        bool valid;
+        // Configured command name, metrics are keyed by it
+        std::string name;
+        // Program arguments, args[0] is resolved program
+        std::vector<std::string> args;
+        // Further stages of pipeline 'cmd1 | cmd2 | ...', every stage reads
+        // stdout of the previous one, empty for plain command
+        std::vector<std::vector<std::string>> piped_args;
+        // Config of the first stage, pipeline takes the shortest timeout
+        // and output limit of the last stage
+        CommandConfig config;
+        // Commands of 'batch' verb, their ids are task ids never used by requests
+        std::vector<ResolvedCommand> batch;
+        // Batch results go out as commands finish instead of in batch order
+        bool completion_order;
+
+        ResolvedCommand() : id(0), verb(Verb::run), job_id(0), valid(false), completion_order(false) {}
+    };
+
     /* Needed for wrapping attempt_launch method return value */ 
     struct AttemptStatus {
         bool attempted;
         bool launched;
         size_t task_id;
-
-        AttemptStatus(bool attempted, bool launched, size_t task_id)
-            : attempted(attempted), launched(launched), task_id(task_id)
+        // Read ends of child's stdout and stderr pipes, -1 if not launched
+        int stdout_fd;
+        int stderr_fd;
+
+        AttemptStatus(bool attempted, bool launched, size_t task_id,
+            int stdout_fd = -1, int stderr_fd = -1)
+            : attempted(attempted), launched(launched), task_id(task_id),
+            stdout_fd(stdout_fd), stderr_fd(stderr_fd)
         {}
     };
 
@@ -35,29 +84,72 @@ public: // methods
     
     /*
         Appends data to data buffer. 
-        After that performs parsing and enqueues command to
-        command queue (if command was parsed).
+        After that performs parsing and enqueues all parsed commands to
+        command queue.
+        Every enqueued command gets next request id, starting from 1.
+        Returns false if binary input is malformed.
+    */
+    bool commit_data(const char* data, size_t length);
+
+    /*
+        Returns protocol of the session, unknown until data is received.
     */
-    void commit_data(const std::string& data);
+    Protocol protocol() const;
+
+    /*
+        Takes next command from command queue and resolves its program.
+        Lines starting with 'submit' resolve the rest of line as job command,
+        'status', 'wait' and 'fetch' take job id, 'capability' takes its name.
+        Commands separated by '|' argument form a pipeline, every stage must be
+        allowed by config and can't be a worker. Jobs can't be pipelines.
+        'batch [--completion-order]' takes commands separated by ';' argument,
+        every command of a batch is resolved on its own.
+        Returns false if queue is empty.
+    */
+    bool next_command(ResolvedCommand& command);
 
     /* 
+        Launches resolved command.
+        Output goes to 'stdout_target' and 'stderr_target' descriptors
+        instead of pipes unless they are -1, they stay owned by the caller.
         Returns AttemptResult struct in which: 
         'attempted' is true if child launch attempted,
         'launched' is true if child launched successfully
-        'task_id' - launched task id.
+        'task_id' - request id of the attempted command,
+        'stdout_fd' and 'stderr_fd' - pipe descriptors owned by the caller,
+        -1 for streams written to targets.
     */
-    AttemptStatus attempt_launch();
+    AttemptStatus attempt_launch(const ResolvedCommand& command,
+        int stdout_target = -1, int stderr_target = -1);
 
     /*
-        Writes stdout and stderr to corresponding arguments. 
-        Returns child exit code.
+        Forgets pid of the child reaped by the server.
+        Returns id of the task which owned the child, 0 if there is no such task,
+        'stage' is set to pipeline stage of the child.
+        Task is still considered running until 'complete_task' is called,
+        so output pipes can be drained after child exit.
     */
-    int write_execution_result(buffer_type& stdout_buf, buffer_type& stderr_buf);
+    size_t release_child(pid_t pid, size_t& stage);
 
     /*
-        Kills child task if 'id' equals to current task id.
+        Finishes task with given id. After that next command can be launched.
     */
-    void kill_task(size_t id);
+    void complete_task(size_t id);
+
+    /*
+        Sends 'signal' to children of the task with given id which are still running.
+    */
+    void kill_task(size_t id, int signal);
+
+    /*
+        Returns number of commands waiting for launch.
+    */
+    size_t queued_commands();
+
+    /*
+        Returns number of launched tasks which are not completed yet.
+    */
+    size_t running_tasks();
 
     /*
         Need this method because of 'chicken & egg' problem.
@@ -67,56 +159,68 @@ public: // methods
 private: // methods
 
     // Command parsing utils
-    std::vector<std::string> tokenize_cmd(const std::string& cmd) const;
-    std::pair<bool, std::string> search_cmd(const std::string& cmd);
+    std::vector<std::string> tokenize_cmd(const std::string& cmd, const char* kept_separators = "|") const;
+    std::pair<bool, CommandConfig> search_cmd(const std::string& cmd);
+    Verb parse_verb(std::vector<std::string>& args, size_t& job_id, bool& valid) const;
+    bool resolve_command(ResolvedCommand& command);
+    bool resolve_pipeline(ResolvedCommand& command);
+    bool resolve_batch(ResolvedCommand& command);
 
     // Child execution utils
-    void set_parent_descriptors(int pipe_stdout[2], int pipe_stderr[2]);
-    void set_child_descriptors(int pipe_stdout[2], int pipe_stderr[2]);
-    pid_t exec_and_bind_streams(const std::vector<std::string>& args);
-    char** create_argv(const std::vector<std::string>& args) const;
-
-    void clear_context();
-    void read_file_to_buf(buffer_type& result, FILE* file);
+    pid_t exec_and_bind_streams(const ResolvedCommand& command, std::vector<pid_t>& piped_pids,
+        int stdout_target, int stderr_target, int& stdout_fd, int& stderr_fd);
 
 
 private: // fields
     
-    // Data buffer
-    std::string data_;
-    // Commands buffer
-    std::queue<std::string> cmd_queue_;
+    /* Received command, binary requests come already split into arguments */
+    struct QueuedCommand {
+        size_t id;
+        std::string line;
+        std::vector<std::string> args;
+    };
+
+    // Data buffers & parsers
+    Protocol protocol_;
+    CommandParser parser_;
+    FrameParser frame_parser_;
+    // Commands buffer, list allocates nothing while session is idle
+    std::queue<QueuedCommand, std::list<QueuedCommand>> cmd_queue_;
+    // Id of the last enqueued command
+    size_t last_request_id_;
+    // Id of the last command of a batch, they count from the upper half of ids
+    size_t last_batch_item_id_;
 
     // Command queue sync stuff
-    boost::mutex queue_mutex_;
+    mutable boost::mutex queue_mutex_;
+
+    // Current config snapshot holder
+    const ConfigStore& config_store_;
 
-    // Reference to config data 
-    const config_data_type& config_;
-    // Mutex for reader lock
-    boost::shared_mutex& config_mutex_;
+    Metrics& metrics_;
 
     // SIGCHLD Dispatching stuff
     dispatcher_type& pid_to_session_map_;
     boost::mutex& signal_mutex_;
 
-    // Current session
-    std::shared_ptr<BaseSession> session_;
+    // Current session, weak because session owns the runner
+    std::weak_ptr<BaseSession> session_;
+
+    // Child launcher
+    ProcessSpawner spawner_;
     
+    /* Children of one task, pid is -1 if child is already reaped */
+    struct RunningTask {
+        pid_t pid;
+        // Further pipeline stages, empty for plain command
+        std::vector<pid_t> piped_pids;
+    };
+
     /* Child sync stuff */
-    boost::atomic<bool> is_running_;
-    // Child process identifier, set to -1 in constructor
-    boost::atomic<pid_t> pid_;
-    // Current child task id, set to 0 in constructor
-    boost::atomic<size_t> task_id_;
+    // Running tasks by task id
+    std::map<size_t, RunningTask> running_tasks_;
     // Mutex for child shared data
     boost::mutex child_mutex_;
-    // Standard output file struct pointer wrapper
-    boost::atomic<FILE*> stdout_; 
-    // Standard error file struct pointer wrapper
-    boost::atomic<FILE*> stderr_;
-
-    enum {buffer_length = settings::process_buffer_length};
-    char buf_[buffer_length];
 };
 
 #endif // PROCESS_RUNNER_H
\ No newline at end of file
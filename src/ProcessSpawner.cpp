@@ -0,0 +1,110 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <csignal>
+
+#include "ProcessSpawner.h"
+
+extern char** environ;
+
+ProcessSpawner::ProcessSpawner(Backend backend)
+    : backend_(backend)
+{}
+
+pid_t ProcessSpawner::spawn(const std::vector<std::string>& args, int stdout_fd, int stderr_fd,
+    int stdin_fd) const {
+    if (args.empty()) {
+        return -1;
+    }
+    // Argv must be built before child creation
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    // Arguments must be guarded by NULL
+    argv.push_back(nullptr);
+
+    if (backend_ == Backend::posix_spawn) {
+        return posix_spawn(argv.data(), stdin_fd, stdout_fd, stderr_fd);
+    }
+    return fork_exec(argv.data(), stdin_fd, stdout_fd, stderr_fd);
+}
+
+pid_t ProcessSpawner::fork_exec(char* const* argv, int stdin_fd, int stdout_fd, int stderr_fd) const {
+    auto pid = fork();
+
+    if (pid != 0) {
+        // We are in the parent, pid is -1 on fork error
+        return pid;
+    }
+    // We are in the child, only async-signal-safe calls are allowed here.
+    // Daemon ignores SIGPIPE, but ignored signals survive exec
+    signal(SIGPIPE, SIG_DFL);
+    if (stdin_fd != -1) {
+        dup2(stdin_fd, STDIN_FILENO);
+    }
+    dup2(stdout_fd, STDOUT_FILENO);
+    dup2(stderr_fd, STDERR_FILENO);
+
+    execv(argv[0], argv);
+    _exit(1);
+}
+
+pid_t ProcessSpawner::posix_spawn(char* const* argv, int stdin_fd, int stdout_fd, int stderr_fd) const {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions)) {
+        return -1;
+    }
+    if (stdin_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    }
+    posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+
+    // Daemon ignores SIGPIPE, but ignored signals survive exec
+    posix_spawnattr_t attributes;
+    if (posix_spawnattr_init(&attributes)) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    auto error = ::posix_spawn(&pid, argv[0], &actions, &attributes, argv, environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return error ? -1 : pid;
+}
+
+bool ProcessSpawner::create_pipe(int fds[2]) {
+    #ifdef __linux__
+    return pipe2(fds, O_CLOEXEC) == 0;
+    #else
+    if (pipe(fds)) {
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+    #endif
+}
+
+bool ProcessSpawner::create_socket_pair(int fds[2]) {
+    #ifdef __linux__
+    return socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0;
+    #else
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+    #endif
+}
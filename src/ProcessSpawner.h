@@ -0,0 +1,58 @@
+#ifndef PROCESS_SPAWNER_H
+#define PROCESS_SPAWNER_H
+
+#include <sys/types.h>
+
+#include <vector>
+#include <string>
+
+class ProcessSpawner {
+public: // structs
+
+    enum class Backend {
+        // fork() + dup2() + execv() in the child
+        fork_exec,
+        // posix_spawn() with file actions, vfork-like on modern libc
+        posix_spawn
+    };
+
+public: // constructors
+
+    ProcessSpawner(Backend backend);
+
+public: // methods
+
+    /*
+        Launches 'args[0]' with arguments 'args'.
+        Child stdout and stderr are redirected to 'stdout_fd' and 'stderr_fd',
+        stdin is redirected to 'stdin_fd' unless it is -1.
+        Returns child pid or -1 on failure.
+        Does not allocate after the child is created, so it is safe
+        to call from multithreaded process.
+    */
+    pid_t spawn(const std::vector<std::string>& args, int stdout_fd, int stderr_fd,
+        int stdin_fd = -1) const;
+
+    /*
+        Creates pipe with close-on-exec flag set on both ends,
+        so concurrently spawned children do not inherit it.
+        Returns false on failure.
+    */
+    static bool create_pipe(int fds[2]);
+
+    /*
+        Same as 'create_pipe', but creates connected pair of unix sockets.
+    */
+    static bool create_socket_pair(int fds[2]);
+
+private: // methods
+
+    pid_t fork_exec(char* const* argv, int stdin_fd, int stdout_fd, int stderr_fd) const;
+    pid_t posix_spawn(char* const* argv, int stdin_fd, int stdout_fd, int stderr_fd) const;
+
+private: // fields
+
+    Backend backend_;
+};
+
+#endif // PROCESS_SPAWNER_H
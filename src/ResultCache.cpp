@@ -0,0 +1,100 @@
+#include "ResultCache.h"
+
+ResultCache::ResultCache(size_t max_bytes)
+    : max_bytes_(max_bytes),
+    used_bytes_(0)
+{}
+
+std::string ResultCache::make_key(const std::vector<std::string>& args) {
+    std::string key;
+    for (auto& arg : args) {
+        // Arguments can't contain NUL, so key is unambiguous
+        key += arg;
+        key += '\0';
+    }
+    return key;
+}
+
+ResultCache::Lookup ResultCache::lookup(const std::string& key, result_handler on_result, result_ptr& result) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        if (it->second->expires > clock_type::now()) {
+            // Move entry to the front of LRU list
+            entries_.splice(entries_.begin(), entries_, it->second);
+            result = it->second->result;
+            return Lookup::hit;
+        }
+        erase(it->second);
+    }
+
+    auto flight = in_flight_.find(key);
+    if (flight != in_flight_.end()) {
+        flight->second.push_back(on_result);
+        return Lookup::joined;
+    }
+    in_flight_[key];
+    return Lookup::leader;
+}
+
+void ResultCache::complete(const std::string& key, const result_ptr& result, size_t ttl) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    std::vector<result_handler> waiters;
+    auto flight = in_flight_.find(key);
+    if (flight != in_flight_.end()) {
+        waiters.swap(flight->second);
+        in_flight_.erase(flight);
+    }
+
+    auto size = key.size() + result->stdout_data.size() + result->stderr_data.size();
+    if (ttl && size <= max_result_size()) {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            erase(it->second);
+        }
+        entries_.push_front(Entry{key, result, clock_type::now() + std::chrono::seconds(ttl), size});
+        index_[key] = entries_.begin();
+        used_bytes_ += size;
+        evict();
+    }
+    lock.unlock();
+
+    for (auto& waiter : waiters) {
+        waiter(result);
+    }
+}
+
+void ResultCache::abandon(const std::string& key) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    std::vector<result_handler> waiters;
+    auto flight = in_flight_.find(key);
+    if (flight != in_flight_.end()) {
+        waiters.swap(flight->second);
+        in_flight_.erase(flight);
+    }
+    lock.unlock();
+
+    for (auto& waiter : waiters) {
+        waiter(result_ptr());
+    }
+}
+
+size_t ResultCache::max_result_size() const {
+    // One result can't push out most of the cache
+    return max_bytes_ / 8;
+}
+
+void ResultCache::erase(std::list<Entry>::iterator it) {
+    used_bytes_ -= it->size;
+    index_.erase(it->key);
+    entries_.erase(it);
+}
+
+void ResultCache::evict() {
+    while (used_bytes_ > max_bytes_ && !entries_.empty()) {
+        erase(std::prev(entries_.end()));
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+#include <boost/thread/mutex.hpp>
+
+#include "types.h"
+
+/*
+    In-memory cache of execution results of idempotent commands.
+    Concurrent identical requests share one execution: the first one
+    becomes leader and executes the command, the others wait for its result.
+    Memory is bounded, least recently used results are evicted first.
+*/
+class ResultCache {
+public: // structs
+
+    typedef CommandResult Result;
+
+    typedef std::shared_ptr<const Result> result_ptr;
+
+    /* Called with null result if leader failed to produce it */
+    typedef std::function<void(result_ptr result)> result_handler;
+
+    enum class Lookup {
+        // Fresh result is found
+        hit,
+        // Same request is executing, result will be passed to handler
+        joined,
+        // Caller must execute request and call 'complete' or 'abandon'
+        leader
+    };
+
+public: // constructors
+
+    ResultCache(size_t max_bytes);
+
+    /* Noncopyable */
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator = (const ResultCache&) = delete;
+
+public: // methods
+
+    /*
+        Builds cache key of the resolved program arguments.
+    */
+    static std::string make_key(const std::vector<std::string>& args);
+
+    /*
+        Looks up result for 'key'. On hit 'result' is set.
+        'on_result' is stored only when request is joined, it is called
+        from the thread which completes the request and must not block.
+    */
+    Lookup lookup(const std::string& key, result_handler on_result, result_ptr& result);
+
+    /*
+        Stores leader's result for 'ttl' seconds and passes it to waiters.
+    */
+    void complete(const std::string& key, const result_ptr& result, size_t ttl);
+
+    /*
+        Drops in-flight request, waiters get null result.
+    */
+    void abandon(const std::string& key);
+
+    /*
+        Returns maximal size of one result which can be cached.
+    */
+    size_t max_result_size() const;
+
+private: // structs
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Entry {
+        std::string key;
+        result_ptr result;
+        clock_type::time_point expires;
+        size_t size;
+    };
+
+private: // methods
+
+    // Must be synchronized
+    void erase(std::list<Entry>::iterator it);
+    void evict();
+
+private: // fields
+
+    size_t max_bytes_;
+    size_t used_bytes_;
+
+    // Most recently used entries are at the front
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+    // Waiters of in-flight requests
+    std::unordered_map<std::string, std::vector<result_handler>> in_flight_;
+
+    boost::mutex mutex_;
+};
+
+#endif // RESULT_CACHE_H
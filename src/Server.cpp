@@ -1,30 +1,72 @@
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
 
 #include "Server.h"
 
 using boost::asio::ip::tcp;
 using boost::asio::local::stream_protocol;
 
+namespace {
+
+void pin_to_core(size_t core) {
+    #ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    // Thread just runs unpinned if core is not available
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    #endif
+}
+
+}
+
 Server::Server(short port,
     size_t thread_pool_size,
-    size_t timeout)
+    bool per_core,
+    size_t timeout,
+    size_t max_running_children)
 
     : thread_pool_size_(thread_pool_size),
+    per_core_(per_core),
     timeout_(timeout),
     quit_signals_(io_service_),
     update_config_signal_(io_service_),
-    config_parser_(settings::config_file_name),
-    config_(config_parser_.parse_config()),
+    child_exit_signal_(io_service_),
+    dump_stats_signal_(io_service_),
+    next_worker_(0),
     tcp_acceptor_(io_service_),
     tcp_endpoint_(tcp::endpoint(tcp::v4(), port)),
 
     #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
     local_acceptor_(io_service_),
-    local_endpoint_(settings::local_socket_address)
+    local_endpoint_(settings::local_socket_address),
+    admin_acceptor_(io_service_),
+    admin_endpoint_(settings::admin_socket_address),
     #endif
 
+    config_parser_(settings::config_file_name),
+    config_store_(std::make_shared<CommandTable>(config_parser_.parse_config())),
+    #ifdef __linux__
+    config_watch_(io_service_),
+    config_watch_buffer_(4096),
+    #endif
+    scheduler_(max_running_children),
+    result_cache_(settings::result_cache_max_bytes),
+    worker_pool_(io_service_, pid_to_session_map_, signal_mutex_),
+    timing_wheel_(io_service_),
+    job_table_(io_service_, timeout, pid_to_session_map_, signal_mutex_, scheduler_, worker_pool_,
+        timing_wheel_)
 {
-    if (config_.empty()) { throw std::logic_error("Config is invalid. "); }
+    if (config_store_.load()->empty()) { throw std::logic_error("Config is invalid. "); }
+    worker_pool_.configure(config_parser_.parse_config());
     // Setting quit signals
     quit_signals_.add(SIGINT);
     quit_signals_.add(SIGTERM);
@@ -34,26 +76,60 @@ Server::Server(short port,
     #endif
     // Signal for config updating
     update_config_signal_.add(SIGHUP);
+    // Signal for reaping children
+    child_exit_signal_.add(SIGCHLD);
+    // Signal for dumping statistics
+    dump_stats_signal_.add(SIGUSR1);
     // Setting handlers for signals
     quit_signals_.async_wait(boost::bind(&Server::handle_stop, this));
     update_config_signal_.async_wait(boost::bind(&Server::handle_update_config, this));
+    child_exit_signal_.async_wait(boost::bind(&Server::handle_child_exit, this));
+    dump_stats_signal_.async_wait(boost::bind(&Server::handle_dump_stats, this));
+
+    #ifdef __linux__
+    // Reload config also when file is changed
+    configure_config_watch();
+    #endif
 
     // Configure endpoints and starting listening for connections
     configure_tcp_endpoint();
     configure_local_endpoint();
+    configure_admin_endpoint();
 }
 
 void Server::configure_tcp_endpoint() {
+    if (!per_core_) {
+        open_tcp_acceptor(tcp_acceptor_, false);
+        tcp_accept(tcp_acceptor_, io_service_);
+        return;
+    }
+    // Kernel balances connections among acceptors bound to the same port
+    for (size_t i = 0; i < thread_pool_size_; ++i) {
+        std::unique_ptr<Worker> worker(new Worker());
+        open_tcp_acceptor(worker->tcp_acceptor, true);
+        tcp_accept(worker->tcp_acceptor, worker->io_service);
+        workers_.push_back(std::move(worker));
+    }
+}
+
+void Server::open_tcp_acceptor(tcp::acceptor& acceptor, bool reuse_port) {
     // Trying to bind tcp endpoint
     boost::system::error_code ec;
-    tcp_acceptor_.open(tcp_endpoint_.protocol());
-    tcp_acceptor_.set_option(tcp::acceptor::reuse_address(true));
-    tcp_acceptor_.bind(tcp_endpoint_, ec);
+    acceptor.open(tcp_endpoint_.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if (reuse_port) {
+        #ifdef SO_REUSEPORT
+        acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+        #else
+        ec = boost::asio::error::operation_not_supported;
+        #endif
+        if (ec) { throw std::logic_error("SO_REUSEPORT is not supported. "); }
+    }
+    acceptor.bind(tcp_endpoint_, ec);
 
     if (ec) { throw std::logic_error("Port is already used. "); }
 
-    tcp_acceptor_.listen();
-    tcp_accept();
+    acceptor.listen();
 }
 
 #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
@@ -71,12 +147,44 @@ void Server::configure_local_endpoint() {
     local_acceptor_.listen();
     local_accept();
 }
+
+void Server::configure_admin_endpoint() {
+    ::unlink(settings::admin_socket_address);
+
+    boost::system::error_code ec;
+    admin_acceptor_.open(admin_endpoint_.protocol());
+    admin_acceptor_.set_option(stream_protocol::acceptor::reuse_address(true));
+    admin_acceptor_.bind(admin_endpoint_, ec);
+
+    if (ec) { throw std::logic_error("Admin address is already used. "); }
+
+    admin_acceptor_.listen();
+    admin_accept();
+}
 #endif
 
 void Server::run() {
     // Initialize worker threads pool
     std::vector<std::shared_ptr<boost::thread>> threads;
 
+    if (per_core_) {
+        auto cores = std::max(1u, boost::thread::hardware_concurrency());
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            auto& worker = *workers_[i];
+            threads.push_back(std::make_shared<boost::thread>([&worker, i, cores]() {
+                pin_to_core(i % cores);
+                worker.io_service.run();
+            }));
+        }
+        // Signals, local and admin sockets are handled by the calling thread
+        io_service_.run();
+
+        for (auto& thread : threads) {
+            thread->join();
+        }
+        return;
+    }
+
     for (size_t i = 0; i < thread_pool_size_; ++i) {
         std::shared_ptr<boost::thread> thread_ptr(new boost::thread(
             boost::bind(&boost::asio::io_service::run, &io_service_)));
@@ -88,60 +196,198 @@ void Server::run() {
     }
 }
 
-void Server::process_child_exit(pid_t pid) {
-    boost::unique_lock<boost::mutex> lock(signal_mutex_);
-
-    auto it = pid_to_session_map_.find(pid);
-    if (it != pid_to_session_map_.end()) {
-        auto session = pid_to_session_map_.at(pid);
-        // Need to erase element from map before handling
-        // child exit, because someone can obtain same pid
-
-        lock.unlock();
-
-        pid_to_session_map_.erase(it->first);
-        session->handle_child_exit();
-    }
-}
-
-void Server::tcp_accept() {
-    SyncData sync_data(config_, config_mutex_, pid_to_session_map_, signal_mutex_);
-    // Create new session to accept
-    auto session = std::make_shared<Session<tcp::socket>>(io_service_, timeout_, sync_data);
+void Server::tcp_accept(tcp::acceptor& acceptor, boost::asio::io_service& io_service) {
+    SyncData sync_data(config_store_, pid_to_session_map_, signal_mutex_,
+        scheduler_, result_cache_, metrics_, worker_pool_, job_table_, timing_wheel_);
+    // Create new session to accept, it lives on the acceptor's io_service.
+    // Session and its control block come from the pool
+    auto session = std::allocate_shared<Session<tcp::socket>>(PoolAllocator<Session<tcp::socket>>(),
+        io_service, timeout_, sync_data);
 
-    tcp_acceptor_.async_accept(session->socket(),
-        [this, session](boost::system::error_code ec) {
+    acceptor.async_accept(session->socket(),
+        [this, session, &acceptor, &io_service](boost::system::error_code ec) {
             if (!ec) {
                 session->start();
             }
             // Go on accepting new sessions
-            tcp_accept();
+            tcp_accept(acceptor, io_service);
         });
 }
 
+boost::asio::io_service& Server::session_io_service() {
+    if (workers_.empty()) {
+        return io_service_;
+    }
+    auto& worker = *workers_[next_worker_];
+    next_worker_ = (next_worker_ + 1) % workers_.size();
+    return worker.io_service;
+}
+
 #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
 void Server::local_accept() {
-    SyncData sync_data(config_, config_mutex_, pid_to_session_map_, signal_mutex_);
-    auto session = std::make_shared<Session<stream_protocol::socket>>(io_service_, timeout_, sync_data);
+    SyncData sync_data(config_store_, pid_to_session_map_, signal_mutex_,
+        scheduler_, result_cache_, metrics_, worker_pool_, job_table_, timing_wheel_);
+    auto& io_service = session_io_service();
+    auto session = std::allocate_shared<Session<stream_protocol::socket>>(
+        PoolAllocator<Session<stream_protocol::socket>>(), io_service, timeout_, sync_data);
 
     local_acceptor_.async_accept(session->socket(),
-        [this, session](boost::system::error_code ec) {
+        [this, session, &io_service](boost::system::error_code ec) {
             if (!ec) {
-                session->start();
+                // Session is served by the thread of its io_service
+                io_service.post([session]() {
+                    session->start();
+                });
             }
             // Go on accepting new sessions
             local_accept();
         });
 }
+
+void Server::admin_accept() {
+    auto socket = std::make_shared<stream_protocol::socket>(io_service_);
+
+    admin_acceptor_.async_accept(*socket,
+        [this, socket](boost::system::error_code ec) {
+            if (!ec) {
+                // Metrics are written right away, connection is closed after that
+                auto metrics = std::make_shared<std::string>(render_metrics());
+                boost::asio::async_write(*socket, boost::asio::buffer(*metrics),
+                    [socket, metrics](boost::system::error_code, size_t) {
+                        boost::system::error_code ignored;
+                        socket->shutdown(stream_protocol::socket::shutdown_both, ignored);
+                    });
+            }
+            admin_accept();
+        });
+}
 #endif
 
+std::string Server::render_metrics() const {
+    std::ostringstream out;
+    metrics_.render(out);
+
+    auto stats = scheduler_.stats();
+    out << "# HELP remote_runnerd_running_children Children holding execution slot.\n"
+        << "# TYPE remote_runnerd_running_children gauge\n"
+        << "remote_runnerd_running_children " << stats.running << "\n"
+        << "# HELP remote_runnerd_waiting_launches Commands waiting for execution slot.\n"
+        << "# TYPE remote_runnerd_waiting_launches gauge\n"
+        << "remote_runnerd_waiting_launches " << stats.queued << "\n";
+    return out.str();
+}
+
+void Server::reload_config() {
+    // Parsing is done aside, lookups keep using old snapshot meanwhile
+    auto data = config_parser_.parse_config();
+    // Posted first, so pools know new commands before requests resolved with them
+    worker_pool_.configure(data);
+    config_store_.store(std::make_shared<CommandTable>(data));
+}
+
 void Server::handle_update_config() {
     update_config_signal_.async_wait(boost::bind(&Server::handle_update_config, this));
-    // Writer lock
-    boost::unique_lock<boost::shared_mutex> lock(config_mutex_);
-    config_ = config_parser_.parse_config();
+    reload_config();
+}
+
+#ifdef __linux__
+void Server::configure_config_watch() {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        // SIGHUP is still available for reloading
+        return;
+    }
+
+    // Watch directory, because editors usually replace the file
+    std::string config_name(settings::config_file_name);
+    auto slash = config_name.rfind('/');
+    auto directory = slash == std::string::npos ? std::string(".")
+        : slash == 0 ? std::string("/") : config_name.substr(0, slash);
+
+    if (inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ::close(fd);
+        return;
+    }
+    config_watch_.assign(fd);
+    watch_config();
+}
+
+void Server::watch_config() {
+    config_watch_.async_read_some(boost::asio::buffer(config_watch_buffer_),
+        [this](boost::system::error_code ec, size_t length) {
+            if (ec) {
+                return;
+            }
+
+            std::string config_name(settings::config_file_name);
+            auto file_name = config_name.substr(config_name.rfind('/') + 1);
+
+            // Reload once per read even if several events refer to config
+            bool changed = false;
+            size_t offset = 0;
+            while (offset + sizeof(inotify_event) <= length) {
+                auto event = reinterpret_cast<const inotify_event*>(&config_watch_buffer_[offset]);
+                if (event->len && file_name == event->name) {
+                    changed = true;
+                }
+                offset += sizeof(inotify_event) + event->len;
+            }
+
+            if (changed) {
+                reload_config();
+            }
+            watch_config();
+        });
+}
+#endif
+
+void Server::handle_child_exit() {
+    child_exit_signal_.async_wait(boost::bind(&Server::handle_child_exit, this));
+
+    // Several SIGCHLDs can be coalesced into one, so reap until nothing is left
+    while (true) {
+        // Need to lock because of possible race conditions with child launching
+        boost::unique_lock<boost::mutex> lock(signal_mutex_);
+
+        int status;
+        rusage usage;
+        auto pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid <= 0) {
+            // No more exited children
+            break;
+        }
+
+        auto it = pid_to_session_map_.find(pid);
+        if (it == pid_to_session_map_.end()) {
+            continue;
+        }
+        auto session = it->second;
+        // Need to erase element from map before handling
+        // child exit, because someone can obtain same pid
+        pid_to_session_map_.erase(it);
+        lock.unlock();
+
+        // Session dispatches exit to its own strand
+        session->handle_child_exit(pid, status, usage);
+    }
+}
+
+void Server::handle_dump_stats() {
+    dump_stats_signal_.async_wait(boost::bind(&Server::handle_dump_stats, this));
+
+    auto stats = scheduler_.stats();
+    auto average_wait_us = stats.granted ? stats.total_wait_us / stats.granted : 0;
+    std::clog << "Scheduler: running " << stats.running << "/" << stats.max_running
+        << ", queued " << stats.queued << " from " << stats.queued_clients << " sessions"
+        << ", granted " << stats.granted
+        << ", average wait " << average_wait_us << " us"
+        << ", max wait " << stats.max_wait_us << " us"
+        << ", runtime estimates of " << stats.estimated_commands << " commands" << std::endl;
 }
 
 void Server::handle_stop() {
     io_service_.stop();
+    for (auto& worker : workers_) {
+        worker->io_service.stop();
+    }
 }
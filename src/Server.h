@@ -10,13 +10,27 @@
 
 #include "Session.h"
 #include "ConfigParser.h"
+#include "ConfigStore.h"
+#include "ExecutionScheduler.h"
+#include "ResultCache.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "JobTable.h"
+#include "TimingWheel.h"
 
 class Server {
 public: // constructors
 
+    /*
+        With 'per_core' every io thread runs its own io_service pinned to a core
+        and accepts TCP connections with its own SO_REUSEPORT acceptor.
+        Otherwise 'thread_pool_size' threads share one io_service.
+    */
     Server(short port,
         size_t thread_pool_size,
-        size_t timeout);
+        bool per_core,
+        size_t timeout,
+        size_t max_running_children);
 
     /* Noncopyable */
     Server(const Server&) = delete;
@@ -29,29 +43,56 @@ public: // methods
     */
     void run();
 
-    /*
-        Dispatches by child pid and handles child exit. 
-    */
-    void process_child_exit(pid_t pid);
+private: // structs
+
+    /* Io thread with its own io_service and acceptor, used in per-core mode */
+    struct Worker {
+        boost::asio::io_service io_service;
+        boost::asio::ip::tcp::acceptor tcp_acceptor;
+
+        // Only one thread runs io_service
+        Worker() : io_service(1), tcp_acceptor(io_service) {}
+    };
 
 private: // methods
     
-    void tcp_accept();
+    void tcp_accept(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::io_service& io_service);
     void configure_tcp_endpoint();
+    void open_tcp_acceptor(boost::asio::ip::tcp::acceptor& acceptor, bool reuse_port);
+
+    // io_service for next session accepted on shared acceptor
+    boost::asio::io_service& session_io_service();
 
     #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
     void local_accept();
     void configure_local_endpoint();
+
+    void admin_accept();
+    void configure_admin_endpoint();
     #endif
 
+    std::string render_metrics() const;
+
+    void reload_config();
     void handle_update_config();
+
+    #ifdef __linux__
+    void configure_config_watch();
+    void watch_config();
+    #endif
+    void handle_child_exit();
+    void handle_dump_stats();
     void handle_stop();
 
 private: // fields
 
     size_t thread_pool_size_;
+    bool per_core_;
     size_t timeout_;
 
+    // Hot path timings and gauges, must outlive sessions
+    Metrics metrics_;
+
     // Asio stuff 
     // Must be initialized before passing to other members
     boost::asio::io_service io_service_;
@@ -61,6 +102,18 @@ private: // fields
 
     boost::asio::signal_set update_config_signal_;
 
+    // SIGCHLD is delivered as io_service event, reaping is done by handler
+    boost::asio::signal_set child_exit_signal_;
+
+    // Signal for dumping scheduler statistics
+    boost::asio::signal_set dump_stats_signal_;
+
+    // Io threads of per-core mode, 'io_service_' handles only signals,
+    // local and admin sockets then
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // Round-robin distribution of local sessions among workers
+    size_t next_worker_;
+
     // Socket acceptors & endpoints
     boost::asio::ip::tcp::acceptor tcp_acceptor_;
     boost::asio::ip::tcp::endpoint tcp_endpoint_;
@@ -68,17 +121,41 @@ private: // fields
     #ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
     boost::asio::local::stream_protocol::acceptor local_acceptor_; 
     boost::asio::local::stream_protocol::endpoint local_endpoint_;
+
+    // Metrics are served on separate socket
+    boost::asio::local::stream_protocol::acceptor admin_acceptor_;
+    boost::asio::local::stream_protocol::endpoint admin_endpoint_;
     #endif
 
-    // Sync & config stuff
+    // Config stuff, snapshot is replaced on reload
     ConfigParser config_parser_;
-    config_data_type config_;
-    boost::shared_mutex config_mutex_;
+    ConfigStore config_store_;
+
+    #ifdef __linux__
+    // Inotify descriptor watching config directory
+    boost::asio::posix::stream_descriptor config_watch_;
+    std::vector<char> config_watch_buffer_;
+    #endif
 
     // SIGCHLD dispatching stuff
     dispatcher_type pid_to_session_map_;
     boost::mutex signal_mutex_;
 
+    // Server-wide child admission control
+    ExecutionScheduler scheduler_;
+
+    // Results of cacheable commands
+    ResultCache result_cache_;
+
+    // Persistent instances of worker commands
+    WorkerPool worker_pool_;
+
+    // Child, job and idle session timeouts
+    TimingWheel timing_wheel_;
+
+    // Asynchronous jobs, outlive sessions which submitted them
+    JobTable job_table_;
+
 };
 
 #endif // SERVER_H
\ No newline at end of file
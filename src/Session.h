@@ -1,7 +1,21 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+#include <cerrno>
 #include <memory>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <csignal>
 
 #include <boost/asio.hpp>
 
@@ -9,6 +23,15 @@
 #include "types.h"
 #include "BaseSession.h"
 #include "ProcessRunner.h"
+#include "ChildTask.h"
+#include "ExecutionScheduler.h"
+#include "ResultCache.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "MemoryPool.h"
+#include "TimingWheel.h"
+#include "JobTable.h"
+#include "MemoryFile.h"
 
 template <typename Socket>
 class Session : public std::enable_shared_from_this<Session<Socket>>, public BaseSession {
@@ -20,7 +43,7 @@ public: // constructors
     Session(const Session&) = delete;
     Session& operator = (const Session&) = delete;
 
-    virtual ~Session() = default;
+    virtual ~Session();
 
 public: // methods
     
@@ -35,19 +58,157 @@ public: // methods
     */
     Socket& socket();
 
+private: // structs
+
+    // Command waiting for execution slot
+    typedef std::list<ProcessRunner::ResolvedCommand>::iterator launch_iterator;
+
+    // Reads output at offset into data, returns number of bytes read, 0 at the end
+    typedef std::function<size_t(size_t offset, char* data, size_t length)> read_handler;
+
+    /* Files which output of a task goes to when memfd capability is enabled */
+    struct MemfdOutput {
+        MemoryFile stdout_file;
+        MemoryFile stderr_file;
+    };
+
+    /* Result of one command of a batch, output is kept until it is written */
+    struct BatchItem {
+        bool done;
+        // False if command was refused, 'error' tells why
+        bool launched;
+        int status;
+        // Empty unless command is a pipeline
+        std::vector<int> stage_statuses;
+        unsigned truncation;
+        std::string error;
+        std::string stdout_data;
+        std::string stderr_data;
+        Metrics::clock_type::time_point started;
+        Metrics::clock_type::time_point finished;
+    };
+
+    struct Batch {
+        // Request id
+        size_t id;
+        bool completion_order;
+        std::vector<BatchItem> items;
+        // Number of written items
+        size_t written;
+    };
+
+    /* Where the task of a batch command reports to */
+    struct BatchSlot {
+        std::shared_ptr<Batch> batch;
+        size_t index;
+    };
+
 private: // methods
 
     void do_read();
+    void handle_read(bool parsed);
 
     void do_write(const std::string& data);
     void do_write(const buffer_type& buffer);
+    void enqueue_write(const std::shared_ptr<buffer_type>& data_ptr);
+    void enqueue_splice(const std::shared_ptr<ChildTask>& task, ChildTask::Stream stream, size_t length);
+    void enqueue_files(const std::shared_ptr<buffer_type>& data_ptr, const std::shared_ptr<MemfdOutput>& files);
+    void enqueue_stream(size_t task_id, ChildTask::Stream stream, size_t length, const read_handler& source);
+    void write_next();
+    void splice_next();
+    void send_files_next();
+    void stream_next();
+    void handle_write_error();
+    void release_written(size_t count);
+    void update_backpressure();
 
     void try_launch_process();
+    bool lookup_cached_result(const ProcessRunner::ResolvedCommand& command);
+    void execute(const ProcessRunner::ResolvedCommand& command);
+    void request_launch(const ProcessRunner::ResolvedCommand& command);
+    void submit_to_worker(const ProcessRunner::ResolvedCommand& command);
+    void finish_worker_request(size_t task_id, const WorkerPool::result_ptr& result);
+    void launch_process(launch_iterator launch);
+    void handle_job_verb(const ProcessRunner::ResolvedCommand& command);
+    void enable_capability(const ProcessRunner::ResolvedCommand& command);
+    std::shared_ptr<MemfdOutput> create_memfd_output(const ProcessRunner::ResolvedCommand& command);
+    void write_memfd_result(size_t task_id, const std::shared_ptr<MemfdOutput>& files);
+    void start_batch(const ProcessRunner::ResolvedCommand& command);
+    bool complete_batch_item(size_t task_id, bool launched, int status, unsigned truncation,
+        const std::vector<int>& stage_statuses, const std::string& error);
+    void write_batch_item(const Batch& batch, size_t index);
+    void write_batch_status(const Batch& batch);
+
+    void write_output_chunk(size_t task_id, ChildTask::Stream stream,
+        const char* data, size_t length);
+    void splice_output_chunk(size_t task_id, ChildTask::Stream stream, size_t length);
+    std::string output_chunk_header(size_t task_id, ChildTask::Stream stream, size_t length) const;
+    void write_status(size_t task_id, int status, unsigned truncation = 0,
+        const std::vector<int>& stage_statuses = std::vector<int>());
+    std::string status_message(int status, unsigned truncation, const std::vector<int>& stage_statuses) const;
+    void write_usage(size_t task_id, const ResourceUsage& usage, Metrics::clock_type::duration runtime);
+    void write_invalid_command(size_t task_id);
+    void write_result(size_t task_id, const ResultCache::Result& result);
+    void write_job_result(size_t task_id, const JobTable::job_ptr& job);
+    void write_message(size_t task_id, const std::string& message);
+    void write_error(size_t task_id, const std::string& message);
+    void write_frame(FrameParser::Type type, size_t task_id, const std::string& payload);
+    void capture_output(size_t task_id, ChildTask::Stream stream, const char* data, size_t length);
+    void finish_task(size_t task_id, const std::string& name);
+    void complete_capture(size_t task_id, int status, unsigned truncation = 0);
+
+    virtual void handle_child_exit(pid_t pid, int status, const rusage& usage);
+
+    std::chrono::seconds command_timeout(const CommandConfig& config) const;
+    void arm_timeout(const std::shared_ptr<ChildTask>& task, std::chrono::milliseconds delay, int signal);
+    void arm_idle_timeout(std::chrono::milliseconds delay);
+    void check_idle();
+
+private: // structs
 
-    virtual void handle_child_exit();
+    /* Write queue entry: either a buffer, child pipe data to splice or output read from source.
+       Buffer may carry descriptors of files, they are sent with its first byte */
+    struct PendingWrite {
+        std::shared_ptr<buffer_type> data;
+        std::shared_ptr<MemfdOutput> files;
+        std::shared_ptr<ChildTask> task;
+        read_handler source;
+        size_t task_id;
+        ChildTask::Stream stream;
+        size_t length;
+        size_t offset;
+        Metrics::clock_type::time_point enqueued;
+
+        PendingWrite(const std::shared_ptr<buffer_type>& data,
+            const std::shared_ptr<MemfdOutput>& files = std::shared_ptr<MemfdOutput>())
+            : data(data), files(files), task_id(0), stream(ChildTask::Stream::output), length(data->size()),
+            offset(0), enqueued(Metrics::clock_type::now())
+        {}
+
+        PendingWrite(const std::shared_ptr<ChildTask>& task, ChildTask::Stream stream, size_t length)
+            : task(task), task_id(0), stream(stream), length(length),
+            offset(0), enqueued(Metrics::clock_type::now())
+        {}
+
+        PendingWrite(size_t task_id, ChildTask::Stream stream, size_t length, const read_handler& source)
+            : source(source), task_id(task_id), stream(stream), length(length),
+            offset(0), enqueued(Metrics::clock_type::now())
+        {}
+    };
+
+    /* Output of a cacheable task executed by this session */
+    struct CacheCapture {
+        std::string key;
+        size_t ttl;
+        std::shared_ptr<ResultCache::Result> result;
+        // Set when output is too large to be cached
+        bool overflow;
+    };
 
 private: // fields
     
+    boost::asio::io_service& io_service_;
+
     // Strand needed for synchronization
     boost::asio::io_service::strand strand_;
 
@@ -56,27 +217,112 @@ private: // fields
     // Child process runner
     ProcessRunner process_runner_;
 
-    // Timer for killing child
-    boost::asio::deadline_timer timer_;
-    // Child timeout
-    boost::posix_time::seconds timeout_;
+    // Server-wide admission control
+    ExecutionScheduler& scheduler_;
+    // Commands waiting for execution slot
+    std::list<ProcessRunner::ResolvedCommand> pending_launches_;
+
+    // Results of cacheable commands
+    ResultCache& result_cache_;
+    // Captured output of running cacheable tasks by request id
+    std::map<size_t, CacheCapture> captures_;
+
+    // Set when client of local socket asked for output in memfds
+    bool memfd_output_;
+    // Output files of running tasks by request id
+    std::map<size_t, std::shared_ptr<MemfdOutput>> memfd_outputs_;
+
+    // Unfinished commands of batches by task id
+    std::map<size_t, BatchSlot> batch_items_;
+    // Commands of started batches waiting for session limit
+    std::list<ProcessRunner::ResolvedCommand> batch_commands_;
+
+    // Persistent workers of worker commands
+    WorkerPool& worker_pool_;
+    // Number of requests sent to worker pool and not completed yet
+    size_t worker_requests_;
+
+    // Asynchronous jobs of all sessions
+    JobTable& job_table_;
+
+    // Default child timeout
+    std::chrono::seconds timeout_;
+
+    // Server-wide timers of child and idle timeouts
+    TimingWheel& timing_wheel_;
+    // Entry closing idle session, 0 if not armed
+    TimingWheel::timer_id idle_timeout_;
+    Metrics::clock_type::time_point last_read_;
+    // Number of 'wait' requests for unfinished jobs
+    size_t job_waits_;
+
+    // Running tasks by request id
+    std::map<size_t, std::shared_ptr<ChildTask>> tasks_;
+
+    // Outgoing data, only front entries are being written.
+    // Lists allocate nothing while empty, unlike deques
+    std::list<PendingWrite> write_queue_;
+    // Bytes of queued buffers, spliced data stays in pipes
+    size_t buffered_bytes_;
+    // Set while child pipes are not read because client is slow
+    bool output_paused_;
+    // Set once a write to the client failed, later output is dropped right away
+    bool write_failed_;
+
+    Metrics& metrics_;
+    // Set when session is accepted and counted as live
+    bool started_;
+
+    // Set when client negotiated binary protocol
+    bool binary_;
 
     enum {buffer_length = settings::session_buffer_length};
-    char data_[buffer_length];
 };
 
 template<class T>
 Session<T>::Session(boost::asio::io_service& io_service, size_t timeout, const SyncData& sync_data)
-    : strand_(io_service), 
+    : io_service_(io_service),
+    strand_(io_service), 
     socket_(io_service),
     process_runner_(sync_data),
-    timer_(io_service),
-    timeout_(timeout)
+    scheduler_(sync_data.scheduler),
+    result_cache_(sync_data.result_cache),
+    memfd_output_(false),
+    worker_pool_(sync_data.worker_pool),
+    worker_requests_(0),
+    job_table_(sync_data.job_table),
+    timeout_(timeout),
+    timing_wheel_(sync_data.timing_wheel),
+    idle_timeout_(0),
+    job_waits_(0),
+    buffered_bytes_(0),
+    output_paused_(false),
+    write_failed_(false),
+    metrics_(sync_data.metrics),
+    started_(false),
+    binary_(false)
 {}
 
+template<class T>
+Session<T>::~Session() {
+    if (idle_timeout_) {
+        timing_wheel_.cancel(idle_timeout_);
+    }
+    metrics_.add(Metrics::Gauge::buffered_bytes, -static_cast<int64_t>(buffered_bytes_));
+    if (started_) {
+        metrics_.add(Metrics::Gauge::sessions, -1);
+    }
+}
+
 template<class T>
 void Session<T>::start() {
+    started_ = true;
+    metrics_.add(Metrics::Gauge::sessions, 1);
     process_runner_.initialize_with_session(this->shared_from_this());
+    last_read_ = Metrics::clock_type::now();
+    if (settings::session_idle_timeout) {
+        arm_idle_timeout(std::chrono::seconds(settings::session_idle_timeout));
+    }
     // Start reading data asynchronously!
     do_read();
 }
@@ -92,41 +338,791 @@ void Session<T>::do_read() {
     // memory invalidation when handler will be executed 
     auto self(this->shared_from_this());
 
-    socket_.async_read_some(boost::asio::buffer(data_, buffer_length),
-        strand_.wrap([this, self](boost::system::error_code ec, size_t length) {
-            if (!ec) {
-                process_runner_.commit_data(std::string(data_, length));
-                try_launch_process();
+    // Wait for data without a buffer, so idle session holds none
+    socket_.async_wait(T::wait_read, strand_.wrap([this, self](boost::system::error_code ec) {
+        if (ec) {
+            return;
+        }
+        bool parsed;
+        {
+            // Buffer is taken from the pool only while data is moved to the parser
+            PooledBuffer<buffer_length> buffer;
+            socket_.non_blocking(true, ec);
+            auto length = socket_.read_some(boost::asio::buffer(buffer.data(), buffer.size()), ec);
+            if (ec == boost::asio::error::would_block) {
                 do_read();
+                return;
             }
-        }));
+            if (ec) {
+                return;
+            }
+            parsed = process_runner_.commit_data(buffer.data(), length);
+        }
+        handle_read(parsed);
+    }));
+}
+
+template<class T>
+void Session<T>::handle_read(bool parsed) {
+    last_read_ = Metrics::clock_type::now();
+    if (!binary_ && process_runner_.protocol() == ProcessRunner::Protocol::binary) {
+        // Acknowledge binary protocol before any frame
+        binary_ = true;
+        enqueue_write(std::make_shared<buffer_type>(FrameParser::magic,
+            FrameParser::magic + sizeof(FrameParser::magic)));
+    }
+    try_launch_process();
+    if (!parsed) {
+        // Framing is lost, nothing more can be read
+        write_error(0, "Malformed frame");
+        return;
+    }
+    do_read();
 }
 
 template<class T>
 void Session<T>::try_launch_process() {
-    auto result = process_runner_.attempt_launch();
+    // Take queued commands while session limit allows
+    while (pending_launches_.size() + worker_requests_ + process_runner_.running_tasks()
+        < settings::session_max_running_tasks) {
+        ProcessRunner::ResolvedCommand command;
+        if (!batch_commands_.empty()) {
+            // Commands of started batches go before further requests
+            command = std::move(batch_commands_.front());
+            batch_commands_.pop_front();
+        } else if (!process_runner_.next_command(command)) {
+            // Nothing to launch
+            return;
+        }
+        if (!command.valid) {
+            write_invalid_command(command.id);
+            continue;
+        }
+        if (command.verb == ProcessRunner::Verb::capability) {
+            enable_capability(command);
+            continue;
+        }
+        if (command.verb == ProcessRunner::Verb::batch) {
+            start_batch(command);
+            continue;
+        }
+        if (command.verb != ProcessRunner::Verb::run) {
+            handle_job_verb(command);
+            continue;
+        }
+        if (command.config.cache_ttl && !lookup_cached_result(command)) {
+            // Result is cached or will be shared with identical request
+            continue;
+        }
+        execute(command);
+    }
+}
+
+// Returns true if command must be executed by this session
+template<class T>
+bool Session<T>::lookup_cached_result(const ProcessRunner::ResolvedCommand& command) {
+    auto self(this->shared_from_this());
+    auto key = ResultCache::make_key(command.args);
+
+    ResultCache::result_ptr result;
+    auto lookup = result_cache_.lookup(key, [this, self, command](ResultCache::result_ptr result) {
+        // Leader can complete on any thread
+        strand_.post([this, self, command, result]() {
+            if (result) {
+                write_result(command.id, *result);
+            } else {
+                // Leader failed, execute command without coalescing
+                execute(command);
+            }
+        });
+    }, result);
+
+    switch (lookup) {
+        case ResultCache::Lookup::hit:
+            write_result(command.id, *result);
+            return false;
+        case ResultCache::Lookup::joined:
+            return false;
+        case ResultCache::Lookup::leader:
+            captures_[command.id] = CacheCapture{key, command.config.cache_ttl,
+                std::make_shared<ResultCache::Result>(), false};
+            return true;
+    }
+    return true;
+}
+
+template<class T>
+void Session<T>::execute(const ProcessRunner::ResolvedCommand& command) {
+    if (command.config.worker_instances) {
+        submit_to_worker(command);
+    } else {
+        request_launch(command);
+    }
+}
+
+template<class T>
+void Session<T>::submit_to_worker(const ProcessRunner::ResolvedCommand& command) {
+    // Worker pool has its own instance limit, no execution slot is needed
+    ++worker_requests_;
+    auto self(this->shared_from_this());
+    auto task_id = command.id;
+    auto name = command.name;
+    auto start = Metrics::clock_type::now();
+
+    worker_pool_.submit(command.name, command.args, command_timeout(command.config).count(),
+        [this, self, task_id, name, start](WorkerPool::result_ptr result) {
+            // Pool completes requests on its own strand
+            strand_.post([this, self, task_id, name, start, result]() {
+                --worker_requests_;
+                metrics_.record_since(Metrics::Phase::runtime, name, start);
+                finish_worker_request(task_id, result);
+                try_launch_process();
+            });
+        });
+}
+
+template<class T>
+void Session<T>::finish_worker_request(size_t task_id, const WorkerPool::result_ptr& result) {
+    if (result) {
+        // Output is captured here if result is cached
+        write_result(task_id, *result);
+        complete_capture(task_id, result->status);
+        return;
+    }
+    // Failed or timed out worker is reported like killed child
+    write_status(task_id, SIGKILL);
+    complete_capture(task_id, SIGKILL);
+}
+
+template<class T>
+void Session<T>::request_launch(const ProcessRunner::ResolvedCommand& command) {
+    pending_launches_.push_back(command);
+    auto launch = std::prev(pending_launches_.end());
+    auto self(this->shared_from_this());
+
+    // Request server-wide execution slot, shorter commands are granted first
+    scheduler_.acquire(this, command.name, [this, self, launch]() {
+        // Grant can come from any thread
+        strand_.post([this, self, launch]() {
+            launch_process(launch);
+        });
+    });
+}
+
+template<class T>
+void Session<T>::launch_process(launch_iterator launch) {
+    // Slot is granted to this very command, not to the oldest one
+    auto command = std::move(*launch);
+    pending_launches_.erase(launch);
+
+    // Output goes to files if client maps it, pipes are the fallback
+    auto files = create_memfd_output(command);
+    auto result = files
+        ? process_runner_.attempt_launch(command, files->stdout_file.fd(), files->stderr_file.fd())
+        : process_runner_.attempt_launch(command);
     auto task_id = result.task_id;
-    
-    if (result.launched) {
-        auto self(this->shared_from_this());
-        timer_.expires_from_now(timeout_);
 
-        timer_.async_wait(strand_.wrap([this, self, task_id](boost::system::error_code ec) {
-            // Check if timer was not cancelled
-            if (ec != boost::asio::error::operation_aborted) {
-                process_runner_.kill_task(task_id);
+    if (!result.launched) {
+        // Attempt to launch process failed, go on with the next command
+        auto capture = captures_.find(task_id);
+        if (capture != captures_.end()) {
+            result_cache_.abandon(capture->second.key);
+            captures_.erase(capture);
+        }
+        write_invalid_command(task_id);
+        scheduler_.release();
+        try_launch_process();
+        return;
+    }
+
+    auto self(this->shared_from_this());
+    auto name = command.name;
+    auto task = std::make_shared<ChildTask>(io_service_,
+        task_id, result.stdout_fd, result.stderr_fd, command.piped_args.size() + 1);
+    tasks_[task_id] = task;
+    if (files) {
+        memfd_outputs_[task_id] = files;
+    }
+    auto slot = batch_items_.find(task_id);
+    if (slot != batch_items_.end()) {
+        // Batch timing does not include wait for execution slot
+        slot->second.batch->items[slot->second.index].started = task->launched_at();
+    }
+
+    arm_timeout(task, command_timeout(command.config), settings::kill_grace_period ? SIGTERM : SIGKILL);
+
+    if (output_paused_) {
+        // Client is slow, output is read when it catches up
+        task->pause_output();
+    }
+
+    if (command.config.output_limit) {
+        task->set_output_limit(command.config.output_limit, command.config.output_policy,
+            [this, self, task_id]() {
+                process_runner_.kill_task(task_id, SIGKILL);
+            });
+    }
+
+    // Output of cacheable task, of batch command and kept tail must pass through memory
+    bool keeps_tail = command.config.output_limit && command.config.output_policy == OutputPolicy::tail;
+    if (settings::splice_output && !captures_.count(task_id) && !batch_items_.count(task_id) && !keeps_tail) {
+        task->set_splice_handler([this, self, task_id](ChildTask::Stream stream, size_t length) {
+            splice_output_chunk(task_id, stream, length);
+        });
+    }
+    task->start(strand_,
+        [this, self, task_id](ChildTask::Stream stream, const char* data, size_t length) {
+            write_output_chunk(task_id, stream, data, length);
+        },
+        [this, self, task_id, name]() {
+            finish_task(task_id, name);
+        });
+}
+
+template<class T>
+void Session<T>::handle_job_verb(const ProcessRunner::ResolvedCommand& command) {
+    auto task_id = command.id;
+    auto job_id = std::to_string(command.job_id);
+    JobTable::State state;
+    JobTable::job_ptr job;
+
+    switch (command.verb) {
+        case ProcessRunner::Verb::submit: {
+            // Job is not cached and does not take session limits
+            auto id = job_table_.submit(command.name, command.args, command.config);
+            if (id) {
+                write_message(task_id, "Job " + std::to_string(id) + " is submitted");
+            } else {
+                write_error(task_id, "Job table is full");
             }
-        }));
-    } else if (result.attempted) {
-        // Attempt to launch process failed
-        std::string error_msg = "Invalid command\n";
-        do_write(error_msg);
+            break;
+        }
+        case ProcessRunner::Verb::status:
+            if (!job_table_.lookup(command.job_id, state, job)) {
+                write_error(task_id, "Unknown job");
+            } else if (state == JobTable::State::queued) {
+                write_message(task_id, "Job " + job_id + " is queued");
+            } else if (state == JobTable::State::running) {
+                write_message(task_id, "Job " + job_id + " is running");
+            } else {
+                write_message(task_id, "Job " + job_id + " is finished");
+            }
+            break;
+        case ProcessRunner::Verb::fetch:
+            if (!job_table_.lookup(command.job_id, state, job)) {
+                write_error(task_id, "Unknown job");
+            } else if (state != JobTable::State::finished) {
+                write_error(task_id, "Job " + job_id + " is not finished");
+            } else {
+                write_job_result(task_id, job);
+            }
+            break;
+        case ProcessRunner::Verb::wait: {
+            auto self(this->shared_from_this());
+            ++job_waits_;
+            job_table_.wait(command.job_id, [this, self, task_id](JobTable::job_ptr job) {
+                // Job finishes on the table strand
+                strand_.post([this, self, task_id, job]() {
+                    --job_waits_;
+                    if (job) {
+                        write_job_result(task_id, job);
+                    } else {
+                        write_error(task_id, "Unknown job");
+                    }
+                });
+            });
+            break;
+        }
+        case ProcessRunner::Verb::run:
+        case ProcessRunner::Verb::capability:
+        case ProcessRunner::Verb::batch:
+            break;
+    }
+}
+
+template<class T>
+void Session<T>::enable_capability(const ProcessRunner::ResolvedCommand& command) {
+    auto& name = command.args[0];
+    // Descriptors can be passed only over local socket
+    bool local = std::is_same<T, boost::asio::local::stream_protocol::socket>::value;
+    MemoryFile probe;
+    if (name == "memfd" && local && probe.create("remote-runnerd-probe")) {
+        memfd_output_ = true;
+        write_message(command.id, "Capability " + name + " is enabled");
+        return;
+    }
+    write_error(command.id, "Capability " + name + " is not supported");
+}
+
+// Returns null if output must go through pipes
+template<class T>
+std::shared_ptr<typename Session<T>::MemfdOutput> Session<T>::create_memfd_output(
+    const ProcessRunner::ResolvedCommand& command) {
+
+    // Cached, batched and limited output must pass through the daemon
+    if (!memfd_output_ || command.config.output_limit || captures_.count(command.id)
+        || batch_items_.count(command.id)) {
+        return std::shared_ptr<MemfdOutput>();
+    }
+    auto files = std::make_shared<MemfdOutput>();
+    if (!files->stdout_file.create("remote-runnerd-stdout")
+        || !files->stderr_file.create("remote-runnerd-stderr")) {
+        return std::shared_ptr<MemfdOutput>();
+    }
+    return files;
+}
+
+template<class T>
+void Session<T>::write_memfd_result(size_t task_id, const std::shared_ptr<MemfdOutput>& files) {
+    // Children are gone, but their descendants may still hold the files
+    bool sealed = files->stdout_file.seal();
+    sealed = files->stderr_file.seal() && sealed;
+    uint64_t stdout_size = files->stdout_file.size();
+    uint64_t stderr_size = files->stderr_file.size();
+    if (!sealed) {
+        // Files may still change, client gets a copy of their content in usual chunks
+        enqueue_stream(task_id, ChildTask::Stream::output, stdout_size,
+            [files](size_t offset, char* data, size_t length) {
+                return files->stdout_file.read(offset, data, length);
+            });
+        enqueue_stream(task_id, ChildTask::Stream::error, stderr_size,
+            [files](size_t offset, char* data, size_t length) {
+                return files->stderr_file.read(offset, data, length);
+            });
+        return;
+    }
+
+    std::string header;
+    if (binary_) {
+        std::string payload;
+        for (auto size : {stdout_size, stderr_size}) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                payload += static_cast<char>(size >> shift);
+            }
+        }
+        header = FrameParser::header(FrameParser::Type::memfd, task_id, payload.size()) + payload;
+    } else {
+        header = "*** MEMFD " + std::to_string(task_id) + " " + std::to_string(stdout_size)
+            + " " + std::to_string(stderr_size) + " ***\n";
+    }
+    enqueue_files(std::make_shared<buffer_type>(header.begin(), header.end()), files);
+}
+
+template<class T>
+void Session<T>::start_batch(const ProcessRunner::ResolvedCommand& command) {
+    auto batch = std::make_shared<Batch>();
+    batch->id = command.id;
+    batch->completion_order = command.completion_order;
+    batch->items.resize(command.batch.size());
+    batch->written = 0;
+
+    // Every command is registered first, so batch can't finish while its commands are started
+    auto now = Metrics::clock_type::now();
+    for (size_t i = 0; i < command.batch.size(); ++i) {
+        batch->items[i].done = false;
+        batch->items[i].started = now;
+        batch_items_[command.batch[i].id] = BatchSlot{batch, i};
+    }
+    // Commands take session limit and execution slots like separate requests,
+    // but report to the batch
+    batch_commands_.insert(batch_commands_.end(), command.batch.begin(), command.batch.end());
+}
+
+// Returns false if task is not a command of a batch
+template<class T>
+bool Session<T>::complete_batch_item(size_t task_id, bool launched, int status, unsigned truncation,
+    const std::vector<int>& stage_statuses, const std::string& error) {
+
+    auto slot = batch_items_.find(task_id);
+    if (slot == batch_items_.end()) {
+        return false;
+    }
+    auto batch = slot->second.batch;
+    auto index = slot->second.index;
+    batch_items_.erase(slot);
+
+    auto& item = batch->items[index];
+    item.done = true;
+    item.launched = launched;
+    item.status = status;
+    item.stage_statuses = stage_statuses;
+    // Item may be truncated by the batch already
+    item.truncation |= truncation;
+    item.error = error;
+    item.finished = Metrics::clock_type::now();
+
+    if (batch->completion_order) {
+        write_batch_item(*batch, index);
+        ++batch->written;
+    }
+    // In batch order an item waits for all items before it
+    while (!batch->completion_order && batch->written < batch->items.size()
+        && batch->items[batch->written].done) {
+        write_batch_item(*batch, batch->written++);
+    }
+    if (batch->written == batch->items.size()) {
+        write_batch_status(*batch);
+    }
+    return true;
+}
+
+template<class T>
+void Session<T>::write_batch_item(const Batch& batch, size_t index) {
+    auto& item = batch.items[index];
+    uint64_t wall_us = std::chrono::duration_cast<std::chrono::microseconds>(item.finished - item.started).count();
+
+    std::string data;
+    if (binary_) {
+        auto append_u32 = [&data](uint32_t value) {
+            for (auto shift : {24, 16, 8, 0}) {
+                data += static_cast<char>(value >> shift);
+            }
+        };
+        append_u32(index);
+        append_u32(wall_us >> 32);
+        append_u32(wall_us);
+        data += static_cast<char>(item.truncation);
+        // Refused command has no statuses and its error in place of stderr
+        if (!item.launched) {
+            append_u32(0);
+        } else if (item.stage_statuses.empty()) {
+            append_u32(1);
+            append_u32(item.status);
+        } else {
+            append_u32(item.stage_statuses.size());
+            for (auto status : item.stage_statuses) {
+                append_u32(status);
+            }
+        }
+        append_u32(item.stdout_data.size());
+        data += item.stdout_data;
+        auto& stderr_data = item.launched ? item.stderr_data : item.error;
+        append_u32(stderr_data.size());
+        data += stderr_data;
+        data = FrameParser::header(FrameParser::Type::batch_item, batch.id, data.size()) + data;
+    } else {
+        data = "*** ITEM " + std::to_string(batch.id) + " " + std::to_string(index)
+            + " " + std::to_string(item.stdout_data.size()) + " " + std::to_string(item.stderr_data.size())
+            + " " + std::to_string(wall_us) + " ***\n" + item.stdout_data + item.stderr_data
+            + (item.launched ? status_message(item.status, item.truncation, item.stage_statuses) : item.error)
+            + "\n";
+    }
+    enqueue_write(std::make_shared<buffer_type>(data.begin(), data.end()));
+}
+
+template<class T>
+void Session<T>::write_batch_status(const Batch& batch) {
+    // Refused command has no status
+    bool successful = true;
+    std::vector<std::string> codes;
+    std::string payload;
+    for (auto& item : batch.items) {
+        successful = successful && item.launched && !item.status;
+        codes.push_back(item.launched ? describe_exit(item.status) : "-");
+        uint32_t value = item.launched ? static_cast<uint32_t>(item.status) : UINT32_MAX;
+        for (auto shift : {24, 16, 8, 0}) {
+            payload += static_cast<char>(value >> shift);
+        }
+    }
+    if (binary_) {
+        write_frame(FrameParser::Type::exit, batch.id, payload);
+        return;
+    }
+    std::string status_msg = "*** STATUS " + std::to_string(batch.id) + " ***\n";
+    if (successful) {
+        status_msg += "Execution is successful";
+    } else {
+        status_msg += "Execution error. Exit codes:";
+        for (size_t i = 0; i < codes.size(); ++i) {
+            status_msg += (i ? ", " : " ") + codes[i];
+        }
+    }
+    status_msg += "\n";
+    do_write(status_msg);
+}
+
+template<class T>
+void Session<T>::write_output_chunk(size_t task_id, ChildTask::Stream stream,
+    const char* data, size_t length) {
+
+    capture_output(task_id, stream, data, length);
+    auto slot = batch_items_.find(task_id);
+    if (slot != batch_items_.end()) {
+        // Batch output is written with its status, so it is truncated like limited output
+        auto& item = slot->second.batch->items[slot->second.index];
+        auto& buffer = stream == ChildTask::Stream::output ? item.stdout_data : item.stderr_data;
+        auto allowed = buffer.size() < settings::batch_item_max_output
+            ? std::min(length, settings::batch_item_max_output - buffer.size()) : 0;
+        buffer.append(data, allowed);
+        if (allowed < length) {
+            item.truncation |= stream == ChildTask::Stream::output ? truncated_stdout : truncated_stderr;
+        }
+        return;
+    }
+
+    auto header = output_chunk_header(task_id, stream, length);
+
+    // Chunk is allocated once, with room for header and data
+    auto chunk = std::make_shared<buffer_type>();
+    chunk->reserve(header.size() + length);
+    chunk->insert(chunk->end(), header.begin(), header.end());
+    chunk->insert(chunk->end(), data, data + length);
+    enqueue_write(chunk);
+}
+
+template<class T>
+void Session<T>::capture_output(size_t task_id, ChildTask::Stream stream, const char* data, size_t length) {
+    auto it = captures_.find(task_id);
+    if (it == captures_.end() || it->second.overflow) {
+        return;
+    }
+    auto& result = *it->second.result;
+    auto& buffer = stream == ChildTask::Stream::output ? result.stdout_data : result.stderr_data;
+    buffer.insert(buffer.end(), data, data + length);
+
+    if (result.stdout_data.size() + result.stderr_data.size() > result_cache_.max_result_size()) {
+        // Too large to be cached, release memory
+        it->second.overflow = true;
+        it->second.result = std::make_shared<ResultCache::Result>();
+    }
+}
+
+template<class T>
+void Session<T>::write_result(size_t task_id, const ResultCache::Result& result) {
+    if (!result.stdout_data.empty()) {
+        write_output_chunk(task_id, ChildTask::Stream::output,
+            result.stdout_data.data(), result.stdout_data.size());
+    }
+    if (!result.stderr_data.empty()) {
+        write_output_chunk(task_id, ChildTask::Stream::error,
+            result.stderr_data.data(), result.stderr_data.size());
+    }
+    write_status(task_id, result.status);
+}
+
+template<class T>
+void Session<T>::write_job_result(size_t task_id, const JobTable::job_ptr& job) {
+    if (!job->launched) {
+        write_invalid_command(task_id);
+        return;
+    }
+    // Spill files are mapped, each chunk is copied from the mapping just before it is written
+    enqueue_stream(task_id, ChildTask::Stream::output, job->stdout_file.size(),
+        [job](size_t offset, char* data, size_t length) {
+            std::memcpy(data, job->stdout_file.data() + offset, length);
+            return length;
+        });
+    enqueue_stream(task_id, ChildTask::Stream::error, job->stderr_file.size(),
+        [job](size_t offset, char* data, size_t length) {
+            std::memcpy(data, job->stderr_file.data() + offset, length);
+            return length;
+        });
+    if (job->runtime != JobTable::clock_type::duration::zero()) {
+        write_usage(task_id, job->usage, job->runtime);
+    }
+    write_status(task_id, job->status, job->truncation);
+}
+
+template<class T>
+void Session<T>::splice_output_chunk(size_t task_id, ChildTask::Stream stream, size_t length) {
+    auto it = tasks_.find(task_id);
+    if (it == tasks_.end()) {
+        return;
+    }
+    // Header is written from memory, chunk itself goes from pipe to socket
+    auto header = output_chunk_header(task_id, stream, length);
+    enqueue_write(std::make_shared<buffer_type>(header.begin(), header.end()));
+    enqueue_splice(it->second, stream, length);
+}
+
+template<class T>
+std::string Session<T>::output_chunk_header(size_t task_id, ChildTask::Stream stream, size_t length) const {
+    if (binary_) {
+        return FrameParser::header(stream == ChildTask::Stream::output ? FrameParser::Type::stdout_chunk
+            : FrameParser::Type::stderr_chunk, task_id, length);
+    }
+    std::string header = stream == ChildTask::Stream::output ? "*** STDOUT " : "*** STDERR ";
+    header += std::to_string(task_id) + " " + std::to_string(length) + " ***\n";
+    return header;
+}
+
+template<class T>
+void Session<T>::finish_task(size_t task_id, const std::string& name) {
+    auto it = tasks_.find(task_id);
+    if (it == tasks_.end()) {
+        return;
+    }
+    auto& task = *it->second;
+    metrics_.record(Metrics::Phase::runtime, name, task.exited_at() - task.launched_at());
+    scheduler_.record_runtime(name, task.exited_at() - task.launched_at());
+    metrics_.record_since(Metrics::Phase::drain, name, task.exited_at());
+
+    auto status = task.status();
+    auto truncation = task.truncation();
+    metrics_.record_usage(name, task.usage());
+
+    auto files = memfd_outputs_.find(task_id);
+    if (files != memfd_outputs_.end()) {
+        // Output files are sent in place of output chunks
+        write_memfd_result(task_id, files->second);
+        memfd_outputs_.erase(files);
+    }
+
+    // Exit status is sent last, after all child output and resource usage
+    write_usage(task_id, task.usage(), task.exited_at() - task.launched_at());
+    write_status(task_id, status, truncation, task.stage_statuses());
+    tasks_.erase(it);
+    process_runner_.complete_task(task_id);
+
+    complete_capture(task_id, status, truncation);
+
+    // Go on launching queued commands
+    try_launch_process();
+}
+
+template<class T>
+void Session<T>::complete_capture(size_t task_id, int status, unsigned truncation) {
+    auto capture = captures_.find(task_id);
+    if (capture == captures_.end()) {
+        return;
+    }
+    if (!capture->second.overflow && !truncation && WIFEXITED(status)) {
+        capture->second.result->status = status;
+        result_cache_.complete(capture->second.key, capture->second.result, capture->second.ttl);
+    } else {
+        // Killed, truncated or too large result is not shared
+        result_cache_.abandon(capture->second.key);
+    }
+    captures_.erase(capture);
+}
+
+template<class T>
+void Session<T>::write_status(size_t task_id, int status, unsigned truncation,
+    const std::vector<int>& stage_statuses) {
+
+    if (complete_batch_item(task_id, true, status, truncation, stage_statuses, std::string())) {
+        return;
+    }
+    if (binary_) {
+        std::string payload;
+        auto append_status = [&payload](int value) {
+            for (auto shift : {24, 16, 8, 0}) {
+                payload += static_cast<char>(static_cast<uint32_t>(value) >> shift);
+            }
+        };
+        if (stage_statuses.empty()) {
+            append_status(status);
+        }
+        // Pipeline reports every stage
+        for (auto stage_status : stage_statuses) {
+            append_status(stage_status);
+        }
+        if (truncation) {
+            payload += static_cast<char>(truncation);
+        }
+        write_frame(FrameParser::Type::exit, task_id, payload);
+        return;
+    }
+    do_write("*** STATUS " + std::to_string(task_id) + " ***\n"
+        + status_message(status, truncation, stage_statuses) + "\n");
+}
+
+template<class T>
+void Session<T>::write_usage(size_t task_id, const ResourceUsage& usage, Metrics::clock_type::duration runtime) {
+    if (batch_items_.count(task_id)) {
+        // Batch reports runtime of its commands itself
+        return;
+    }
+    uint64_t values[] = {
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(runtime).count()),
+        usage.user_us, usage.system_us, usage.max_rss_kb,
+        usage.voluntary_switches, usage.involuntary_switches, usage.input_blocks, usage.output_blocks
+    };
+    std::string data;
+    if (binary_) {
+        for (auto value : values) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                data += static_cast<char>(value >> shift);
+            }
+        }
+        write_frame(FrameParser::Type::usage, task_id, data);
+        return;
+    }
+    data = "*** USAGE " + std::to_string(task_id);
+    for (auto value : values) {
+        data += " " + std::to_string(value);
+    }
+    data += " ***\n";
+    // Header line is not NUL terminated, status follows it
+    enqueue_write(std::make_shared<buffer_type>(data.begin(), data.end()));
+}
+
+template<class T>
+std::string Session<T>::status_message(int status, unsigned truncation,
+    const std::vector<int>& stage_statuses) const {
+
+    std::string status_msg;
+    if (!status) {
+        status_msg += "Execution is successful";
+    } else if (!stage_statuses.empty()) {
+        status_msg += "Execution error. Exit codes:";
+        for (size_t i = 0; i < stage_statuses.size(); ++i) {
+            status_msg += (i ? ", " : " ") + describe_exit(stage_statuses[i]);
+        }
+    } else if (WIFSIGNALED(status)) {
+        status_msg += "Execution error. Killed by " + describe_exit(status);
+    } else {
+        status_msg += "Execution error. Exit code: " + describe_exit(status);
+    }
+    if (truncation & killed_by_output_limit) {
+        status_msg += " (output limit exceeded)";
+    } else if (truncation) {
+        status_msg += (truncation & truncated_stdout) && (truncation & truncated_stderr)
+            ? " (stdout and stderr truncated)"
+            : (truncation & truncated_stdout) ? " (stdout truncated)" : " (stderr truncated)";
     }
+    return status_msg;
+}
+
+template<class T>
+void Session<T>::write_message(size_t task_id, const std::string& message) {
+    if (binary_) {
+        // Message is the output of successful request
+        write_frame(FrameParser::Type::stdout_chunk, task_id, message + "\n");
+        write_status(task_id, 0);
+        return;
+    }
+    do_write("*** STATUS " + std::to_string(task_id) + " ***\n" + message + "\n");
+}
+
+template<class T>
+void Session<T>::write_error(size_t task_id, const std::string& message) {
+    if (complete_batch_item(task_id, false, 0, 0, std::vector<int>(), message)) {
+        return;
+    }
+    if (binary_) {
+        write_frame(FrameParser::Type::error, task_id, message);
+        return;
+    }
+    do_write("*** STATUS " + std::to_string(task_id) + " ***\n" + message + "\n");
+}
+
+template<class T>
+void Session<T>::write_frame(FrameParser::Type type, size_t task_id, const std::string& payload) {
+    auto frame = FrameParser::header(type, task_id, payload.size()) + payload;
+    // Frames are not NUL terminated
+    enqueue_write(std::make_shared<buffer_type>(frame.begin(), frame.end()));
+}
+
+template<class T>
+void Session<T>::write_invalid_command(size_t task_id) {
+    write_error(task_id, "Invalid command");
 }
 
 template<class T>
 void Session<T>::do_write(const std::string& data) {
-    do_write(buffer_type(data.c_str(), data.c_str() + data.length() + 1));
+    // Terminating NUL is sent too
+    enqueue_write(std::make_shared<buffer_type>(data.c_str(), data.c_str() + data.length() + 1));
 }
 
 template<class T>
@@ -135,38 +1131,398 @@ void Session<T>::do_write(const buffer_type& buffer) {
         // There is no data to write
         return;
     }
+    enqueue_write(std::make_shared<buffer_type>(buffer));
+}
+
+template<class T>
+void Session<T>::enqueue_write(const std::shared_ptr<buffer_type>& data_ptr) {
+    if (write_failed_) {
+        // Nothing will ever complete a write
+        return;
+    }
+    buffered_bytes_ += data_ptr->size();
+    metrics_.add(Metrics::Gauge::buffered_bytes, data_ptr->size());
+    write_queue_.push_back(PendingWrite(data_ptr));
+    if (write_queue_.size() == 1) {
+        // No write in progress
+        write_next();
+    }
+    update_backpressure();
+}
+
+template<class T>
+void Session<T>::enqueue_splice(const std::shared_ptr<ChildTask>& task, ChildTask::Stream stream, size_t length) {
+    if (write_failed_) {
+        // Pipe is drained by reading, so the task can finish and release its slot
+        task->stop_splicing();
+        task->resume_output(stream);
+        return;
+    }
+    write_queue_.push_back(PendingWrite(task, stream, length));
+    if (write_queue_.size() == 1) {
+        // No write in progress
+        write_next();
+    }
+}
+
+template<class T>
+void Session<T>::enqueue_files(const std::shared_ptr<buffer_type>& data_ptr,
+    const std::shared_ptr<MemfdOutput>& files) {
+
+    if (write_failed_) {
+        return;
+    }
+    buffered_bytes_ += data_ptr->size();
+    metrics_.add(Metrics::Gauge::buffered_bytes, data_ptr->size());
+    write_queue_.push_back(PendingWrite(data_ptr, files));
+    if (write_queue_.size() == 1) {
+        // No write in progress
+        write_next();
+    }
+}
+
+template<class T>
+void Session<T>::enqueue_stream(size_t task_id, ChildTask::Stream stream, size_t length,
+    const read_handler& source) {
+
+    if (write_failed_ || !length) {
+        return;
+    }
+    write_queue_.push_back(PendingWrite(task_id, stream, length, source));
+    if (write_queue_.size() == 1) {
+        // No write in progress
+        write_next();
+    }
+}
+
+template<class T>
+void Session<T>::write_next() {
+    if (write_queue_.front().task) {
+        splice_next();
+        return;
+    }
+    if (write_queue_.front().files) {
+        send_files_next();
+        return;
+    }
+    if (write_queue_.front().source) {
+        stream_next();
+        return;
+    }
     auto self(this->shared_from_this());
-    auto data_ptr = std::make_shared<buffer_type>(buffer);
 
-    boost::asio::async_write(socket_, boost::asio::buffer(&(*data_ptr)[0], data_ptr->size()),
-        strand_.wrap([this, self, data_ptr](boost::system::error_code ec, size_t) {}));
+    // Consecutive buffers go out with one gathering write, up to the next splice or files
+    std::vector<boost::asio::const_buffer> buffers;
+    for (auto& pending : write_queue_) {
+        if (pending.task || pending.files || pending.source
+            || buffers.size() == settings::session_max_write_batch) {
+            break;
+        }
+        buffers.push_back(boost::asio::buffer(*pending.data));
+    }
+    auto count = buffers.size();
+
+    // Only one write at a time, otherwise chunks can interleave on the socket.
+    // Queued entries keep their buffers alive until completion
+    boost::asio::async_write(socket_, buffers,
+        strand_.wrap([this, self, count](boost::system::error_code ec, size_t) {
+            if (ec) {
+                handle_write_error();
+                return;
+            }
+            release_written(count);
+            if (!write_queue_.empty()) {
+                write_next();
+            }
+        }));
 }
 
 template<class T>
-void Session<T>::handle_child_exit() {
-    // SIGCHLD received
-    // Need to cancel timer task because we are finished
-    timer_.cancel();
+void Session<T>::release_written(size_t count) {
+    size_t released = 0;
+    auto now = Metrics::clock_type::now();
+    for (size_t i = 0; i < count; ++i) {
+        auto& pending = write_queue_.front();
+        released += pending.data->size();
+        metrics_.record(Metrics::Phase::write, std::string(), now - pending.enqueued);
+        write_queue_.pop_front();
+    }
+    buffered_bytes_ -= released;
+    metrics_.add(Metrics::Gauge::buffered_bytes, -static_cast<int64_t>(released));
+    update_backpressure();
+}
 
-    buffer_type stdout;
-    buffer_type stderr;
-    auto status = process_runner_.write_execution_result(stdout, stderr); 
-    if (!status) {
-        // All is OK, writing stdout to client
-        do_write("Execution is successful\n");
-    } else {
-        std::string error_msg = "Execution error. Exit code: ";
-        error_msg += std::to_string(status);
-        error_msg += "\n";
-        do_write(error_msg);
+template<class T>
+void Session<T>::update_backpressure() {
+    bool pause = output_paused_ ? buffered_bytes_ > settings::session_write_high_water / 2
+        : buffered_bytes_ >= settings::session_write_high_water;
+    if (pause == output_paused_) {
+        return;
     }
-    do_write("*** STDOUT ***\n");
-    do_write(stdout);
-    do_write("*** STDERR ***\n");
-    do_write(stderr);
+    output_paused_ = pause;
+    for (auto& task : tasks_) {
+        if (pause) {
+            task.second->pause_output();
+        } else {
+            task.second->unpause_output();
+        }
+    }
+}
 
-    // Go on launching queued commands
-    try_launch_process();
+template<class T>
+void Session<T>::splice_next() {
+    auto& pending = write_queue_.front();
+
+    boost::system::error_code ec;
+    socket_.native_non_blocking(true, ec);
+
+    while (!ec && pending.length) {
+        auto moved = pending.task->splice_to(pending.stream, socket_.native_handle(), pending.length);
+        if (moved > 0) {
+            pending.length -= moved;
+        } else if (moved < 0 && errno == EINTR) {
+            continue;
+        } else if (moved < 0 && errno == EAGAIN) {
+            // Socket buffer is full, continue when it becomes writable
+            auto self(this->shared_from_this());
+            socket_.async_wait(T::wait_write, strand_.wrap([this, self](boost::system::error_code ec) {
+                if (ec) {
+                    handle_write_error();
+                    return;
+                }
+                splice_next();
+            }));
+            return;
+        } else {
+            ec = boost::asio::error::broken_pipe;
+        }
+    }
+    if (ec) {
+        handle_write_error();
+        return;
+    }
+
+    auto task = pending.task;
+    auto stream = pending.stream;
+    metrics_.record_since(Metrics::Phase::write, std::string(), pending.enqueued);
+    write_queue_.pop_front();
+    // Pipe is drained by the length announced in header, reading can go on
+    task->resume_output(stream);
+
+    if (!write_queue_.empty()) {
+        write_next();
+    }
+}
+
+template<class T>
+void Session<T>::send_files_next() {
+    auto& pending = write_queue_.front();
+
+    boost::system::error_code ec;
+    socket_.native_non_blocking(true, ec);
+
+    int fds[2] = {pending.files->stdout_file.fd(), pending.files->stderr_file.fd()};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec data = {pending.data->data(), pending.data->size()};
+
+    msghdr message = {};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket_.native_handle(), &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // Socket buffer is full, continue when it becomes writable
+        auto self(this->shared_from_this());
+        socket_.async_wait(T::wait_write, strand_.wrap([this, self](boost::system::error_code ec) {
+            if (ec) {
+                handle_write_error();
+                return;
+            }
+            send_files_next();
+        }));
+        return;
+    }
+    if (sent <= 0) {
+        handle_write_error();
+        return;
+    }
+
+    // Descriptors went with the first byte, client has its own copies now
+    pending.files.reset();
+    if (static_cast<size_t>(sent) < pending.data->size()) {
+        // Rest of header is an ordinary buffer
+        pending.data->erase(pending.data->begin(), pending.data->begin() + sent);
+        buffered_bytes_ -= sent;
+        metrics_.add(Metrics::Gauge::buffered_bytes, -static_cast<int64_t>(sent));
+        write_next();
+        return;
+    }
+    release_written(1);
+    if (!write_queue_.empty()) {
+        write_next();
+    }
+}
+
+template<class T>
+void Session<T>::stream_next() {
+    auto& pending = write_queue_.front();
+
+    // Only one chunk is read and in flight, the rest stays in the source
+    size_t length = settings::process_buffer_length;
+    auto piece = std::make_shared<buffer_type>(std::min(pending.length - pending.offset, length));
+    auto count = pending.source(pending.offset, piece->data(), piece->size());
+    if (!count) {
+        // Source ended early, the chunks written so far are all of it
+        metrics_.record_since(Metrics::Phase::write, std::string(), pending.enqueued);
+        write_queue_.pop_front();
+        if (!write_queue_.empty()) {
+            write_next();
+        }
+        return;
+    }
+    piece->resize(count);
+    pending.offset += count;
+
+    auto header = std::make_shared<std::string>(output_chunk_header(pending.task_id, pending.stream, count));
+    std::vector<boost::asio::const_buffer> buffers = {
+        boost::asio::buffer(*header), boost::asio::buffer(*piece)};
+
+    auto self(this->shared_from_this());
+    boost::asio::async_write(socket_, buffers,
+        strand_.wrap([this, self, header, piece](boost::system::error_code ec, size_t) {
+            if (ec) {
+                handle_write_error();
+                return;
+            }
+            auto& pending = write_queue_.front();
+            if (pending.offset == pending.length) {
+                metrics_.record_since(Metrics::Phase::write, std::string(), pending.enqueued);
+                write_queue_.pop_front();
+                if (write_queue_.empty()) {
+                    return;
+                }
+            }
+            write_next();
+        }));
+}
+
+template<class T>
+void Session<T>::handle_write_error() {
+    // Client is gone, drop queued data but let paused tasks drain their pipes.
+    // Failure is sticky, later output is dropped when it is enqueued
+    write_failed_ = true;
+    std::list<PendingWrite> dropped;
+    dropped.swap(write_queue_);
+    for (auto& pending : dropped) {
+        if (pending.task) {
+            pending.task->stop_splicing();
+            pending.task->resume_output(pending.stream);
+        } else if (pending.data) {
+            buffered_bytes_ -= pending.data->size();
+            metrics_.add(Metrics::Gauge::buffered_bytes, -static_cast<int64_t>(pending.data->size()));
+        }
+    }
+    update_backpressure();
+}
+
+template<class T>
+void Session<T>::handle_child_exit(pid_t pid, int status, const rusage& usage) {
+    // Child is reaped by the server
+    auto self(this->shared_from_this());
+
+    strand_.post([this, self, pid, status, usage]() {
+        size_t stage = 0;
+        auto task_id = process_runner_.release_child(pid, stage);
+
+        auto it = tasks_.find(task_id);
+        if (it != tasks_.end()) {
+            auto task = it->second;
+            // Pipes may still hold data, status is written when they are drained
+            task->handle_exit(status, usage, stage);
+            if (task->exited()) {
+                timing_wheel_.cancel(task->timeout());
+                // Slot is not held while output waits for a slow or dead client
+                scheduler_.release();
+            }
+        }
+    });
+}
+
+template<class T>
+std::chrono::seconds Session<T>::command_timeout(const CommandConfig& config) const {
+    return config.timeout ? std::chrono::seconds(config.timeout) : timeout_;
+}
+
+template<class T>
+void Session<T>::arm_timeout(const std::shared_ptr<ChildTask>& task, std::chrono::milliseconds delay, int signal) {
+    // Wheel must not keep finished session alive
+    std::weak_ptr<Session> weak(this->shared_from_this());
+    auto task_id = task->id();
+
+    task->set_timeout(timing_wheel_.schedule(delay, [this, weak, task_id, signal]() {
+        auto self = weak.lock();
+        if (!self) {
+            return;
+        }
+        strand_.post([this, self, task_id, signal]() {
+            auto it = tasks_.find(task_id);
+            if (it == tasks_.end()) {
+                return;
+            }
+            process_runner_.kill_task(task_id, signal);
+            if (signal != SIGKILL) {
+                // Child which ignores SIGTERM is killed after grace period
+                arm_timeout(it->second, std::chrono::seconds(settings::kill_grace_period), SIGKILL);
+            }
+        });
+    }));
+}
+
+template<class T>
+void Session<T>::arm_idle_timeout(std::chrono::milliseconds delay) {
+    std::weak_ptr<Session> weak(this->shared_from_this());
+
+    idle_timeout_ = timing_wheel_.schedule(delay, [this, weak]() {
+        auto self = weak.lock();
+        if (!self) {
+            return;
+        }
+        strand_.post([this, self]() {
+            idle_timeout_ = 0;
+            check_idle();
+        });
+    });
+}
+
+template<class T>
+void Session<T>::check_idle() {
+    std::chrono::milliseconds timeout(std::chrono::seconds(settings::session_idle_timeout));
+    bool busy = !tasks_.empty() || !pending_launches_.empty() || !batch_commands_.empty()
+        || worker_requests_ || job_waits_ || !write_queue_.empty() || process_runner_.queued_commands();
+    if (busy) {
+        arm_idle_timeout(timeout);
+        return;
+    }
+    auto idle_for = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Metrics::clock_type::now() - last_read_);
+    if (idle_for >= timeout) {
+        // Pending read is aborted and session goes away
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        return;
+    }
+    arm_idle_timeout(timeout - idle_for);
 }
 
 #endif // SESSION_H
\ No newline at end of file
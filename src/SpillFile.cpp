@@ -0,0 +1,84 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+#include "SpillFile.h"
+
+SpillFile::SpillFile()
+    : fd_(-1),
+    size_(0),
+    mapping_(nullptr)
+{}
+
+SpillFile::~SpillFile() {
+    if (mapping_) {
+        munmap(mapping_, size_);
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+bool SpillFile::open(const std::string& directory) {
+    std::string name = directory + "/remote-runnerd-job.XXXXXX";
+    std::vector<char> path(name.begin(), name.end());
+    path.push_back('\0');
+
+    #ifdef __linux__
+    fd_ = mkostemp(path.data(), O_CLOEXEC);
+    #else
+    fd_ = mkstemp(path.data());
+    if (fd_ != -1) {
+        fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    }
+    #endif
+    if (fd_ == -1) {
+        return false;
+    }
+    // File lives while it is open, nothing is left behind on crash
+    unlink(path.data());
+    return true;
+}
+
+bool SpillFile::append(const char* data, size_t length) {
+    while (length) {
+        auto written = write(fd_, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+        size_ += written;
+    }
+    return true;
+}
+
+bool SpillFile::seal() {
+    bool mapped = true;
+    if (size_) {
+        mapping_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (mapping_ == MAP_FAILED) {
+            mapping_ = nullptr;
+            size_ = 0;
+            mapped = false;
+        }
+    }
+    // Mapping keeps file alive
+    close(fd_);
+    fd_ = -1;
+    return mapped;
+}
+
+const char* SpillFile::data() const {
+    return static_cast<const char*>(mapping_);
+}
+
+size_t SpillFile::size() const {
+    return mapping_ ? size_ : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef SPILL_FILE_H
+#define SPILL_FILE_H
+
+#include <string>
+
+/*
+    Unlinked temporary file collecting output of one stream.
+    Once sealed, content is mapped to memory, so kept output costs
+    no heap and is paged in only when read.
+*/
+class SpillFile {
+public: // constructors
+
+    SpillFile();
+
+    ~SpillFile();
+
+    /* Noncopyable */
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator = (const SpillFile&) = delete;
+
+public: // methods
+
+    /*
+        Creates file in 'directory'. Returns false on error.
+    */
+    bool open(const std::string& directory);
+
+    /*
+        Appends data to the end of file. Returns false on error,
+        data written before stays readable.
+    */
+    bool append(const char* data, size_t length);
+
+    /*
+        Maps written content and closes file. Nothing can be appended after that.
+    */
+    bool seal();
+
+    /*
+        Sealed content, null if file is empty.
+    */
+    const char* data() const;
+
+    size_t size() const;
+
+private: // fields
+
+    int fd_;
+    size_t size_;
+    void* mapping_;
+};
+
+#endif // SPILL_FILE_H
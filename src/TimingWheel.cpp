@@ -0,0 +1,139 @@
+#include <algorithm>
+
+#include "settings.h"
+#include "TimingWheel.h"
+
+const size_t TimingWheel::level_bits;
+const size_t TimingWheel::slot_count;
+const size_t TimingWheel::level_count;
+
+TimingWheel::TimingWheel(boost::asio::io_service& io_service)
+    : timer_(io_service),
+    ticking_(false),
+    epoch_(clock_type::now()),
+    current_tick_(0),
+    slots_(level_count * slot_count),
+    last_id_(0)
+{}
+
+TimingWheel::timer_id TimingWheel::schedule(std::chrono::milliseconds delay, handler_type handler) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    auto now = now_tick();
+    if (!ticking_) {
+        // Wheel is empty, it can jump straight to now
+        current_tick_ = now;
+    }
+    // Rounded up, so entry never fires early
+    uint64_t ticks = (delay.count() + settings::timer_wheel_tick_ms - 1) / settings::timer_wheel_tick_ms;
+    auto id = ++last_id_;
+    place(Entry{id, std::max(now, current_tick_) + std::max<uint64_t>(ticks, 1), handler});
+
+    if (!ticking_) {
+        ticking_ = true;
+        start_timer();
+    }
+    return id;
+}
+
+bool TimingWheel::cancel(timer_id id) {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    auto it = locations_.find(id);
+    if (it == locations_.end()) {
+        return false;
+    }
+    it->second.slot->erase(it->second.entry);
+    locations_.erase(it);
+    return true;
+}
+
+size_t TimingWheel::size() const {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    return locations_.size();
+}
+
+void TimingWheel::place(Entry&& entry) {
+    auto ticks_left = entry.expires > current_tick_ ? entry.expires - current_tick_ : 0;
+    size_t level = 0;
+    while (level + 1 < level_count && ticks_left >= (uint64_t(1) << (level_bits * (level + 1)))) {
+        ++level;
+    }
+    // Entries beyond the top level wait in its farthest slot and are cascaded again
+    uint64_t span = uint64_t(1) << (level_bits * level_count);
+    auto position = std::min(entry.expires, current_tick_ + span - 1);
+    auto index = (position >> (level_bits * level)) & (slot_count - 1);
+
+    auto& slot = slots_[level * slot_count + index];
+    auto id = entry.id;
+    slot.push_back(std::move(entry));
+    locations_[id] = Location{&slot, std::prev(slot.end())};
+}
+
+void TimingWheel::cascade(size_t level) {
+    auto index = (current_tick_ >> (level_bits * level)) & (slot_count - 1);
+    slot_type entries;
+    entries.swap(slots_[level * slot_count + index]);
+    for (auto& entry : entries) {
+        place(std::move(entry));
+    }
+}
+
+void TimingWheel::advance(std::vector<handler_type>& expired) {
+    ++current_tick_;
+
+    // Highest level whose slot boundary is crossed, lower levels are cascaded after it
+    size_t level = 0;
+    while (level + 1 < level_count
+        && (current_tick_ & ((uint64_t(1) << (level_bits * (level + 1))) - 1)) == 0) {
+        ++level;
+    }
+    for (; level > 0; --level) {
+        cascade(level);
+    }
+
+    auto& slot = slots_[current_tick_ & (slot_count - 1)];
+    for (auto it = slot.begin(); it != slot.end();) {
+        if (it->expires > current_tick_) {
+            ++it;
+            continue;
+        }
+        expired.push_back(std::move(it->handler));
+        locations_.erase(it->id);
+        it = slot.erase(it);
+    }
+}
+
+uint64_t TimingWheel::now_tick() const {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - epoch_);
+    return elapsed.count() / settings::timer_wheel_tick_ms;
+}
+
+void TimingWheel::start_timer() {
+    auto next = epoch_ + std::chrono::milliseconds((current_tick_ + 1) * settings::timer_wheel_tick_ms);
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(next - clock_type::now());
+    timer_.expires_from_now(boost::posix_time::milliseconds(std::max<int64_t>(delay.count(), 0)));
+    timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec) {
+            handle_tick();
+        }
+    });
+}
+
+void TimingWheel::handle_tick() {
+    std::vector<handler_type> expired;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        // Timer can be late, every missed tick is processed
+        auto now = now_tick();
+        while (current_tick_ < now) {
+            advance(expired);
+        }
+        if (locations_.empty()) {
+            ticking_ = false;
+        } else {
+            start_timer();
+        }
+    }
+    for (auto& handler : expired) {
+        handler();
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+
+/*
+    Server-wide hierarchical timing wheel driven by one deadline timer.
+    Level 0 has 'slot_count' slots of 'settings::timer_wheel_tick_ms',
+    every next level has slots as long as the whole previous level.
+    Entries of a higher level slot are cascaded down when lower level wraps,
+    so scheduling and cancelling are O(1) regardless of the number of timers.
+    Timer ticks only while there are scheduled entries.
+*/
+class TimingWheel {
+public: // structs
+
+    typedef uint64_t timer_id;
+    typedef std::function<void()> handler_type;
+
+public: // constructors
+
+    TimingWheel(boost::asio::io_service& io_service);
+
+    /* Noncopyable */
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator = (const TimingWheel&) = delete;
+
+public: // methods
+
+    /*
+        Calls 'handler' once after 'delay', rounded up to the wheel tick.
+        Handler is called from the wheel's io_service thread, so it must not
+        block and should post to the caller's strand.
+        Returns id for cancelling, never 0.
+    */
+    timer_id schedule(std::chrono::milliseconds delay, handler_type handler);
+
+    /*
+        Forgets entry if it has not fired yet. Returns false if it already fired.
+    */
+    bool cancel(timer_id id);
+
+    /* Number of scheduled entries */
+    size_t size() const;
+
+public: // constants
+
+    static const size_t level_bits = 8;
+    static const size_t slot_count = 1 << level_bits;
+    static const size_t level_count = 4;
+
+private: // structs
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Entry {
+        timer_id id;
+        // Absolute tick of expiration
+        uint64_t expires;
+        handler_type handler;
+    };
+
+    typedef std::list<Entry> slot_type;
+
+    struct Location {
+        slot_type* slot;
+        slot_type::iterator entry;
+    };
+
+private: // methods
+
+    // Must be synchronized
+    void place(Entry&& entry);
+    void cascade(size_t level);
+    void advance(std::vector<handler_type>& expired);
+    uint64_t now_tick() const;
+    void start_timer();
+    void handle_tick();
+
+private: // fields
+
+    boost::asio::deadline_timer timer_;
+    bool ticking_;
+
+    clock_type::time_point epoch_;
+    // Last processed tick
+    uint64_t current_tick_;
+
+    std::vector<slot_type> slots_;
+    std::unordered_map<timer_id, Location> locations_;
+    timer_id last_id_;
+
+    mutable boost::mutex mutex_;
+};
+
+#endif // TIMING_WHEEL_H
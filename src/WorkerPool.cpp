@@ -0,0 +1,408 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include <csignal>
+#include <algorithm>
+
+#include "settings.h"
+#include "WorkerPool.h"
+
+using boost::asio::local::stream_protocol;
+
+namespace {
+
+const auto tick_period = boost::posix_time::seconds(1);
+
+void put_u32(std::string& out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+uint32_t get_u32(const unsigned char* data) {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+}
+
+WorkerPool::Instance::Instance(WorkerPool& owner, const std::shared_ptr<Pool>& pool, pid_t pid, int channel_fd)
+    : owner(owner),
+    pool(pool),
+    pid(pid),
+    channel(owner.io_service_, stream_protocol(), channel_fd),
+    timer(owner.io_service_),
+    served(0),
+    stopping(false),
+    idle_since(clock_type::now())
+{}
+
+bool WorkerPool::Instance::busy() const {
+    return static_cast<bool>(request.on_result);
+}
+
+void WorkerPool::Instance::handle_child_exit(pid_t, int, const rusage&) {
+    auto self(shared_from_this());
+    auto& pool_owner = owner;
+    owner.strand_.post([&pool_owner, self]() {
+        pool_owner.handle_exit(self);
+    });
+}
+
+WorkerPool::WorkerPool(boost::asio::io_service& io_service,
+    dispatcher_type& pid_to_session_map,
+    boost::mutex& signal_mutex)
+
+    : io_service_(io_service),
+    strand_(io_service),
+    tick_timer_(io_service),
+    ticking_(false),
+    pid_to_session_map_(pid_to_session_map),
+    signal_mutex_(signal_mutex),
+    spawner_(settings::use_posix_spawn ? ProcessSpawner::Backend::posix_spawn
+        : ProcessSpawner::Backend::fork_exec)
+{}
+
+void WorkerPool::configure(const config_data_type& config) {
+    strand_.post([this, config]() {
+        do_configure(config);
+    });
+}
+
+void WorkerPool::submit(const std::string& command, const std::vector<std::string>& args,
+    size_t timeout, result_handler on_result) {
+
+    // Request is encoded by the caller, pool strand only moves bytes
+    Request request{encode_request(args), timeout, on_result};
+    strand_.post([this, command, request]() {
+        do_submit(command, request);
+    });
+}
+
+void WorkerPool::do_configure(const config_data_type& config) {
+    std::map<std::string, pool_ptr> pools;
+    for (auto& command : config) {
+        if (!command.second.worker_instances) {
+            continue;
+        }
+        auto it = pools_.find(command.first);
+        if (it != pools_.end() && it->second->config.program == command.second.program) {
+            // Same program, running instances are kept with new limits
+            it->second->config = command.second;
+            pools[command.first] = it->second;
+            pools_.erase(it);
+            continue;
+        }
+        auto pool = std::make_shared<Pool>();
+        pool->config = command.second;
+        pool->retired = false;
+        pools[command.first] = pool;
+    }
+
+    // Pools left are removed or changed
+    for (auto& entry : pools_) {
+        auto pool = entry.second;
+        pool->retired = true;
+
+        auto replacement = pools.find(entry.first);
+        if (replacement != pools.end()) {
+            // Queued requests go to the new program
+            auto& queue = replacement->second->queue;
+            queue.insert(queue.end(), pool->queue.begin(), pool->queue.end());
+            pool->queue.clear();
+        } else {
+            fail_queued(pool);
+        }
+
+        auto instances = pool->instances;
+        for (auto& instance : instances) {
+            if (!instance->busy()) {
+                stop(instance, false);
+            }
+        }
+        if (!pool->instances.empty()) {
+            retired_.push_back(pool);
+        }
+    }
+    pools_.swap(pools);
+
+    for (auto& entry : pools_) {
+        if (entry.second->instances.empty()) {
+            // Keep one instance warm
+            spawn(entry.second);
+        }
+        dispatch(entry.second);
+    }
+
+    if (!ticking_) {
+        ticking_ = true;
+        handle_tick();
+    }
+}
+
+void WorkerPool::do_submit(const std::string& command, const Request& request) {
+    auto it = pools_.find(command);
+    if (it == pools_.end()) {
+        // Command stopped being worker after it was resolved
+        request.on_result(result_ptr());
+        return;
+    }
+    it->second->queue.push_back(request);
+    dispatch(it->second);
+}
+
+void WorkerPool::dispatch(const pool_ptr& pool) {
+    while (!pool->queue.empty()) {
+        instance_ptr idle;
+        for (auto& instance : pool->instances) {
+            if (!instance->busy() && !instance->stopping) {
+                idle = instance;
+                break;
+            }
+        }
+        if (!idle) {
+            // Grow pool up to its limit
+            if (!pool->retired && pool->instances.size() < pool->config.worker_instances && spawn(pool)) {
+                continue;
+            }
+            if (pool->instances.empty()) {
+                // Nobody is going to serve queued requests
+                fail_queued(pool);
+            }
+            return;
+        }
+        auto request = pool->queue.front();
+        pool->queue.pop_front();
+        send(idle, request);
+    }
+}
+
+bool WorkerPool::spawn(const pool_ptr& pool) {
+    int channel[2];
+    if (!ProcessSpawner::create_socket_pair(channel)) {
+        return false;
+    }
+    std::vector<std::string> args{pool->config.program};
+
+    // Need to lock because of possible race conditions with SIGCHLD receiving
+    boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
+    auto pid = spawner_.spawn(args, channel[1], STDERR_FILENO, channel[1]);
+    // Worker end is used only by the child
+    close(channel[1]);
+
+    if (pid < 0) {
+        close(channel[0]);
+        return false;
+    }
+    auto instance = std::make_shared<Instance>(*this, pool, pid, channel[0]);
+    // Register pid for future SIGCHLD dispatching
+    pid_to_session_map_[pid] = instance;
+    signal_lock.unlock();
+
+    pool->instances.push_back(instance);
+    return true;
+}
+
+void WorkerPool::send(const instance_ptr& instance, const Request& request) {
+    instance->request = request;
+    auto served = ++instance->served;
+
+    instance->timer.expires_from_now(boost::posix_time::seconds(request.timeout));
+    instance->timer.async_wait(strand_.wrap([this, instance, served](boost::system::error_code ec) {
+        // Check if timer was not cancelled
+        if (!ec && instance->served == served && instance->busy()) {
+            fail(instance);
+        }
+    }));
+
+    auto payload = request.payload;
+    boost::asio::async_write(instance->channel, boost::asio::buffer(*payload),
+        strand_.wrap([this, instance, served, payload](boost::system::error_code ec, size_t) {
+            if (ec && instance->served == served && instance->busy() && !instance->stopping) {
+                fail(instance);
+            }
+        }));
+    read_header(instance, served);
+}
+
+void WorkerPool::read_header(const instance_ptr& instance, size_t served) {
+    boost::asio::async_read(instance->channel, boost::asio::buffer(instance->header),
+        strand_.wrap([this, instance, served](boost::system::error_code ec, size_t) {
+            if (instance->served != served || !instance->busy() || instance->stopping) {
+                // Request already failed
+                return;
+            }
+            if (ec) {
+                fail(instance);
+                return;
+            }
+            size_t exit_code = get_u32(instance->header);
+            size_t stdout_length = get_u32(instance->header + 4);
+            size_t stderr_length = get_u32(instance->header + 8);
+            if (stdout_length + stderr_length > settings::worker_max_response_bytes) {
+                fail(instance);
+                return;
+            }
+            read_body(instance, served, exit_code, stdout_length, stderr_length);
+        }));
+}
+
+void WorkerPool::read_body(const instance_ptr& instance, size_t served,
+    size_t exit_code, size_t stdout_length, size_t stderr_length) {
+
+    auto result = std::make_shared<CommandResult>();
+    // Status has the same format as for spawned children
+    result->status = (exit_code & 0xff) << 8;
+
+    instance->body = std::make_shared<buffer_type>(stdout_length + stderr_length);
+    if (instance->body->empty()) {
+        complete(instance, result);
+        return;
+    }
+    boost::asio::async_read(instance->channel, boost::asio::buffer(*instance->body),
+        strand_.wrap([this, instance, served, result, stdout_length](boost::system::error_code ec, size_t) {
+            if (instance->served != served || !instance->busy() || instance->stopping) {
+                return;
+            }
+            if (ec) {
+                fail(instance);
+                return;
+            }
+            auto& body = *instance->body;
+            result->stdout_data.assign(body.begin(), body.begin() + stdout_length);
+            result->stderr_data.assign(body.begin() + stdout_length, body.end());
+            instance->body.reset();
+            complete(instance, result);
+        }));
+}
+
+void WorkerPool::complete(const instance_ptr& instance, const result_ptr& result) {
+    instance->timer.cancel();
+    auto on_result = instance->request.on_result;
+    instance->request = Request();
+    instance->idle_since = clock_type::now();
+    on_result(result);
+
+    auto pool = instance->pool.lock();
+    if (!pool) {
+        return;
+    }
+    if (pool->retired || (pool->config.worker_recycle && instance->served >= pool->config.worker_recycle)) {
+        // Replacement is spawned on demand or by the next tick
+        stop(instance, false);
+    }
+    dispatch(pool);
+}
+
+void WorkerPool::fail(const instance_ptr& instance) {
+    if (instance->busy()) {
+        auto on_result = instance->request.on_result;
+        instance->request = Request();
+        on_result(result_ptr());
+    }
+    stop(instance, true);
+
+    auto pool = instance->pool.lock();
+    if (pool) {
+        dispatch(pool);
+    }
+}
+
+void WorkerPool::stop(const instance_ptr& instance, bool kill_now) {
+    if (instance->stopping) {
+        return;
+    }
+    instance->stopping = true;
+    instance->timer.cancel();
+
+    auto pool = instance->pool.lock();
+    if (pool) {
+        auto& instances = pool->instances;
+        instances.erase(std::remove(instances.begin(), instances.end(), instance), instances.end());
+    }
+
+    if (kill_now) {
+        kill_instance(instance);
+    } else {
+        // Worker which ignores EOF is killed, and reaped by the server like any child
+        instance->timer.expires_from_now(boost::posix_time::seconds(settings::worker_stop_timeout));
+        instance->timer.async_wait(strand_.wrap([this, instance](boost::system::error_code ec) {
+            if (!ec) {
+                kill_instance(instance);
+            }
+        }));
+    }
+    // Worker reads EOF from stdin and is expected to exit
+    boost::system::error_code ignored;
+    instance->channel.close(ignored);
+}
+
+void WorkerPool::kill_instance(const instance_ptr& instance) {
+    // Reaped worker is not registered anymore, its pid may belong to another process
+    boost::unique_lock<boost::mutex> signal_lock(signal_mutex_);
+    if (pid_to_session_map_.count(instance->pid)) {
+        kill(instance->pid, SIGKILL);
+    }
+}
+
+void WorkerPool::fail_queued(const pool_ptr& pool) {
+    std::deque<Request> queue;
+    queue.swap(pool->queue);
+    for (auto& request : queue) {
+        request.on_result(result_ptr());
+    }
+}
+
+void WorkerPool::handle_exit(const instance_ptr& instance) {
+    if (instance->stopping) {
+        // Worker exited as expected, it needs no kill
+        instance->timer.cancel();
+        return;
+    }
+    // Worker crashed or exited on its own
+    fail(instance);
+}
+
+void WorkerPool::handle_tick() {
+    auto now = clock_type::now();
+    auto idle_timeout = std::chrono::seconds(settings::worker_idle_timeout);
+
+    for (auto& entry : pools_) {
+        auto pool = entry.second;
+        // Shrink idle pool down to one warm instance
+        auto instances = pool->instances;
+        for (auto& instance : instances) {
+            if (pool->instances.size() > 1 && !instance->busy() && now - instance->idle_since > idle_timeout) {
+                stop(instance, false);
+            }
+        }
+        if (pool->instances.empty()) {
+            // Crashed or recycled instance is replaced here, at most once per tick
+            spawn(pool);
+        }
+        dispatch(pool);
+    }
+
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [](const pool_ptr& pool) {
+        return pool->instances.empty();
+    }), retired_.end());
+
+    tick_timer_.expires_from_now(tick_period);
+    tick_timer_.async_wait(strand_.wrap([this](boost::system::error_code ec) {
+        if (!ec) {
+            handle_tick();
+        }
+    }));
+}
+
+std::shared_ptr<std::string> WorkerPool::encode_request(const std::vector<std::string>& args) {
+    std::string arguments;
+    // Program itself is not sent, worker already knows who it is
+    for (size_t i = 1; i < args.size(); ++i) {
+        arguments += args[i];
+        arguments += '\0';
+    }
+    auto payload = std::make_shared<std::string>();
+    put_u32(*payload, arguments.size());
+    *payload += arguments;
+    return payload;
+}
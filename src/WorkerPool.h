@@ -0,0 +1,161 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "types.h"
+#include "BaseSession.h"
+#include "ProcessSpawner.h"
+
+/*
+    Pools of long-lived instances of persistent worker commands.
+    Instead of spawning a child per request, requests are routed to idle
+    instances over their stdin/stdout, which are one end of a socket pair:
+        request:  <u32 length> <length bytes: arguments, each terminated by '\0'>
+        response: <u32 exit code> <u32 stdout length> <u32 stderr length>
+                  <stdout bytes> <stderr bytes>
+    Integers are big-endian.
+    Pool of a command grows up to 'worker_instances' instances with load
+    and shrinks to one warm instance when idle. Instances are respawned
+    when they crash, time out or served 'worker_recycle' requests.
+    Stopped instance gets EOF on its stdin and is killed if it does not exit
+    in 'settings::worker_stop_timeout' seconds.
+    All pool state is touched only from the pool strand.
+*/
+class WorkerPool {
+public: // structs
+
+    typedef std::shared_ptr<const CommandResult> result_ptr;
+
+    /* Called with null result if worker failed or timed out */
+    typedef std::function<void(result_ptr result)> result_handler;
+
+public: // constructors
+
+    WorkerPool(boost::asio::io_service& io_service,
+        dispatcher_type& pid_to_session_map,
+        boost::mutex& signal_mutex);
+
+    /* Noncopyable */
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator = (const WorkerPool&) = delete;
+
+public: // methods
+
+    /*
+        Starts one warm instance of every worker command of 'config'.
+        Pools of commands which are removed or changed are retired:
+        their instances stop after the current request.
+    */
+    void configure(const config_data_type& config);
+
+    /*
+        Sends 'args' (args[0] is the program) to an instance of worker 'command'.
+        Instance is killed if it does not respond in 'timeout' seconds.
+        'on_result' is called from the pool strand and must not block.
+    */
+    void submit(const std::string& command, const std::vector<std::string>& args,
+        size_t timeout, result_handler on_result);
+
+private: // structs
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Request {
+        std::shared_ptr<std::string> payload;
+        size_t timeout;
+        result_handler on_result;
+    };
+
+    struct Pool;
+
+    /* One running worker process, registered for SIGCHLD dispatching */
+    struct Instance : public BaseSession, public std::enable_shared_from_this<Instance> {
+        WorkerPool& owner;
+        std::weak_ptr<Pool> pool;
+        pid_t pid;
+        // Connected to worker stdin and stdout, writes to it never raise SIGPIPE
+        boost::asio::local::stream_protocol::socket channel;
+        boost::asio::deadline_timer timer;
+
+        // Request being served, empty handler if instance is idle
+        Request request;
+        // Incremented per request, stale timer and io handlers are ignored
+        size_t served;
+        bool stopping;
+        clock_type::time_point idle_since;
+
+        unsigned char header[12];
+        std::shared_ptr<buffer_type> body;
+
+        Instance(WorkerPool& owner, const std::shared_ptr<Pool>& pool, pid_t pid, int channel_fd);
+
+        bool busy() const;
+
+        virtual void handle_child_exit(pid_t pid, int status, const rusage& usage);
+    };
+
+    typedef std::shared_ptr<Instance> instance_ptr;
+
+    struct Pool {
+        CommandConfig config;
+        std::vector<instance_ptr> instances;
+        std::deque<Request> queue;
+        // Set when command is removed or changed by config reload
+        bool retired;
+    };
+
+    typedef std::shared_ptr<Pool> pool_ptr;
+
+private: // methods
+
+    // Must be called from the strand
+    void do_configure(const config_data_type& config);
+    void do_submit(const std::string& command, const Request& request);
+    void dispatch(const pool_ptr& pool);
+    bool spawn(const pool_ptr& pool);
+    void send(const instance_ptr& instance, const Request& request);
+    void read_header(const instance_ptr& instance, size_t served);
+    void read_body(const instance_ptr& instance, size_t served,
+        size_t exit_code, size_t stdout_length, size_t stderr_length);
+    void complete(const instance_ptr& instance, const result_ptr& result);
+    void fail(const instance_ptr& instance);
+    void stop(const instance_ptr& instance, bool kill_now);
+    void kill_instance(const instance_ptr& instance);
+    void fail_queued(const pool_ptr& pool);
+    void handle_exit(const instance_ptr& instance);
+    void handle_tick();
+
+    static std::shared_ptr<std::string> encode_request(const std::vector<std::string>& args);
+
+private: // fields
+
+    boost::asio::io_service& io_service_;
+    boost::asio::io_service::strand strand_;
+
+    // Pools of configured worker commands
+    std::map<std::string, pool_ptr> pools_;
+    // Retired pools with instances still serving requests
+    std::vector<pool_ptr> retired_;
+
+    // Timer for shrinking idle pools and keeping instances warm
+    boost::asio::deadline_timer tick_timer_;
+    bool ticking_;
+
+    // SIGCHLD Dispatching stuff
+    dispatcher_type& pid_to_session_map_;
+    boost::mutex& signal_mutex_;
+
+    ProcessSpawner spawner_;
+};
+
+#endif // WORKER_POOL_H
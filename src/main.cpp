@@ -1,24 +1,56 @@
+#include <unistd.h>
 #include <csignal>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include "Server.h"
 #include "settings.h"
 
-std::shared_ptr<Server> server_ptr;
-
-void child_exit_handler(int signum, siginfo_t* info, void* context) {
-    server_ptr->process_child_exit(info->si_pid);
-}
-
 void usage() {
-    std::cout << "USAGE: remote-runnerd <timeout>" << std::endl;
+    std::cout << "USAGE: remote-runnerd [-c <max_children>] [-t <threads>] [-p] <timeout>" << std::endl
+        << "  -c <max_children>  server-wide limit of running children, "
+        << "number of cores by default" << std::endl
+        << "  -t <threads>       number of io threads, " << settings::server_thread_pool_size
+        << " by default, number of cores with -p" << std::endl
+        << "  -p                 one io_service per thread, threads are pinned to cores "
+        << "and accept TCP connections with SO_REUSEPORT" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    // Zero means number of cores
+    size_t max_children = 0;
+    // Zero means default for selected mode
+    size_t threads = 0;
+    bool per_core = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "c:t:p")) != -1) {
+        try {
+            switch (option) {
+                case 'c':
+                    max_children = boost::lexical_cast<size_t>(optarg);
+                    break;
+                case 't':
+                    threads = boost::lexical_cast<size_t>(optarg);
+                    break;
+                case 'p':
+                    per_core = true;
+                    break;
+                default:
+                    usage();
+                    exit(1);
+            }
+        } catch (const boost::bad_lexical_cast& e) {
+            std::cerr << "Bad option value. " << e.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
         usage();
         exit(0);
     }
@@ -30,17 +62,18 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    // Write to a closed socket must fail with EPIPE instead of killing the daemon,
+    // splice of child output into a socket can't pass MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
     try {
-        size_t timeout = boost::lexical_cast<size_t>(argv[1]);
-        server_ptr = std::make_shared<Server>(
-            settings::port, settings::server_thread_pool_size, timeout);
-
-        // Signal handler initializing
-        struct sigaction sa;
-        sa.sa_sigaction = &child_exit_handler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction(SIGCHLD, &sa, nullptr);
+        size_t timeout = boost::lexical_cast<size_t>(argv[optind]);
+        if (!threads) {
+            threads = per_core ? std::max(1u, boost::thread::hardware_concurrency())
+                : settings::server_thread_pool_size;
+        }
+        auto server_ptr = std::make_shared<Server>(
+            settings::port, threads, per_core, timeout, max_children);
 
         server_ptr->run();
         exit(0);
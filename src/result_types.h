@@ -0,0 +1,77 @@
+#ifndef RESULT_TYPES_H
+#define RESULT_TYPES_H
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <csignal>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Types of execution results shared by the daemon and the client library.
+    Header must not depend on daemon internals.
+*/
+
+/* Bits of truncation flags reported with execution status */
+enum TruncationFlag : unsigned {
+    truncated_stdout = 1,
+    truncated_stderr = 2,
+    killed_by_output_limit = 4
+};
+
+/* Resources used by the children of one command, pipeline stages are summed up */
+struct ResourceUsage {
+    uint64_t user_us;
+    uint64_t system_us;
+    // Largest resident set of a child
+    uint64_t max_rss_kb;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t input_blocks;
+    uint64_t output_blocks;
+
+    ResourceUsage()
+        : user_us(0), system_us(0), max_rss_kb(0), voluntary_switches(0),
+        involuntary_switches(0), input_blocks(0), output_blocks(0)
+    {}
+
+    void add(const rusage& usage) {
+        user_us += usage.ru_utime.tv_sec * 1000000ull + usage.ru_utime.tv_usec;
+        system_us += usage.ru_stime.tv_sec * 1000000ull + usage.ru_stime.tv_usec;
+        // Linux reports kilobytes
+        max_rss_kb = std::max<uint64_t>(max_rss_kb, usage.ru_maxrss);
+        voluntary_switches += usage.ru_nvcsw;
+        involuntary_switches += usage.ru_nivcsw;
+        input_blocks += usage.ru_inblock;
+        output_blocks += usage.ru_oublock;
+    }
+};
+
+/* Exit code of waitpid status, or the signal which killed the child */
+inline std::string describe_exit(int status) {
+    if (WIFSIGNALED(status)) {
+        return "signal " + std::to_string(WTERMSIG(status));
+    }
+    return std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : status);
+}
+
+/*
+    Status of a pipeline, the status of its first failed stage.
+    Upstream stage killed by SIGPIPE only saw a later stage stop reading,
+    like 'seq 100000 | head -n 1', so it does not fail the pipeline.
+*/
+inline int pipeline_status(const std::vector<int>& stage_statuses) {
+    for (size_t i = 0; i < stage_statuses.size(); ++i) {
+        auto status = stage_statuses[i];
+        bool broken_pipe = WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE;
+        if (status && !(broken_pipe && i + 1 < stage_statuses.size())) {
+            return status;
+        }
+    }
+    return 0;
+}
+
+#endif // RESULT_TYPES_H
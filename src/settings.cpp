@@ -4,6 +4,56 @@ const char* settings::config_file_name = "/etc/remote-runnerd.conf";
 
 const char* settings::local_socket_address = "/tmp/simple-telnetd";
 
+const char* settings::admin_socket_address = "/tmp/remote-runnerd-admin";
+
 const size_t settings::server_thread_pool_size = 5;
 
-const size_t settings::port = 12345;
\ No newline at end of file
+const size_t settings::port = 12345;
+
+const bool settings::use_posix_spawn = true;
+
+const size_t settings::session_max_running_tasks = 8;
+
+const bool settings::splice_output = true;
+
+const size_t settings::splice_threshold = 16384;
+
+const size_t settings::result_cache_max_bytes = 64 << 20;
+
+const size_t settings::worker_idle_timeout = 60;
+
+const size_t settings::worker_max_response_bytes = 64 << 20;
+
+const size_t settings::worker_stop_timeout = 5;
+
+const char* settings::job_spool_directory = "/tmp";
+
+const size_t settings::job_retention = 600;
+
+const size_t settings::job_table_max_jobs = 10000;
+
+const size_t settings::max_frame_length = 1 << 20;
+
+const size_t settings::session_write_high_water = 1 << 20;
+
+const size_t settings::session_max_write_batch = 64;
+
+const size_t settings::memory_pool_max_free_blocks = 1024;
+
+const size_t settings::timer_wheel_tick_ms = 100;
+
+const size_t settings::kill_grace_period = 2;
+
+const size_t settings::session_idle_timeout = 600;
+
+const size_t settings::max_pipeline_stages = 8;
+
+const double settings::scheduler_runtime_weight = 0.2;
+
+const size_t settings::scheduler_default_runtime_ms = 100;
+
+const size_t settings::scheduler_quantum_ms = 10;
+
+const size_t settings::max_batch_commands = 32;
+
+const size_t settings::batch_item_max_output = 1 << 20;
\ No newline at end of file
@@ -6,8 +6,59 @@
 struct settings {
     static const char* config_file_name;
     static const char* local_socket_address;
+    // Local socket serving metrics in Prometheus text format
+    static const char* admin_socket_address;
     static const size_t server_thread_pool_size;
     static const size_t port;
+    // posix_spawn() launcher if true, fork() + execv() otherwise
+    static const bool use_posix_spawn;
+    // Maximum number of concurrently running commands of one session
+    static const size_t session_max_running_tasks;
+    // Move large child output from pipe to socket with splice() (Linux only)
+    static const bool splice_output;
+    // Minimal number of buffered pipe bytes which are spliced instead of read
+    static const size_t splice_threshold;
+    // Memory limit of cached results of cacheable commands
+    static const size_t result_cache_max_bytes;
+    // Idle worker instances above one per command are stopped after this many seconds
+    static const size_t worker_idle_timeout;
+    // Larger worker responses are treated as worker failure
+    static const size_t worker_max_response_bytes;
+    // Stopped worker which does not exit on EOF of its stdin is killed after this many seconds
+    static const size_t worker_stop_timeout;
+    // Directory of unlinked files holding output of asynchronous jobs
+    static const char* job_spool_directory;
+    // Finished jobs are forgotten after this many seconds
+    static const size_t job_retention;
+    // Maximal number of queued, running and retained jobs
+    static const size_t job_table_max_jobs;
+    // Child pipes of a session are not read while more output bytes wait for the client,
+    // reading resumes below half of it
+    static const size_t session_write_high_water;
+    // Maximal number of queued buffers sent by one gathering write
+    static const size_t session_max_write_batch;
+    // Larger binary protocol frames are treated as malformed input
+    static const size_t max_frame_length;
+    // Resolution of the server-wide timing wheel
+    static const size_t timer_wheel_tick_ms;
+    // Timed out child gets SIGTERM, then SIGKILL after this many seconds (0 - SIGKILL at once)
+    static const size_t kill_grace_period;
+    // Connections with nothing running are closed after this many seconds without input, 0 - never
+    static const size_t session_idle_timeout;
+    // Weight of the last runtime in the runtime estimate of a command
+    static const double scheduler_runtime_weight;
+    // Expected runtime of commands which never ran
+    static const size_t scheduler_default_runtime_ms;
+    // Expected runtime a waiting client may be granted per round-robin turn
+    static const size_t scheduler_quantum_ms;
+    // Maximal number of commands in one pipeline request
+    static const size_t max_pipeline_stages;
+    // Maximal number of commands in one batch request
+    static const size_t max_batch_commands;
+    // Output of a batch command kept per stream until its result is written, the rest is dropped
+    static const size_t batch_item_max_output;
+    // Freed blocks kept by every memory pool for reuse
+    static const size_t memory_pool_max_free_blocks;
     static const constexpr size_t session_buffer_length = 1024;
     static const constexpr size_t process_buffer_length = 1024;
 };
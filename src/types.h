@@ -7,31 +7,93 @@
 #include <string>
 
 #include <boost/thread/mutex.hpp>
-#include <boost/thread/shared_mutex.hpp>
 
 #include "BaseSession.h"
+#include "result_types.h"
 
-typedef std::map<std::string, std::string> config_data_type;
+class ConfigStore;
+class ExecutionScheduler;
+class Metrics;
+class WorkerPool;
+class JobTable;
+class TimingWheel;
+class ResultCache;
+
+/* What happens to output over 'CommandConfig::output_limit' bytes */
+enum class OutputPolicy {
+    // First bytes are kept, the rest is dropped
+    head,
+    // Last bytes are kept in a ring buffer and sent when child finishes
+    tail,
+    // First bytes are kept and child is killed
+    kill
+};
+
+/* Configuration of one allowed command */
+struct CommandConfig {
+    // Executable name
+    std::string program;
+    // Results are cached for 'cache_ttl' seconds, 0 if command is not cacheable
+    size_t cache_ttl;
+    // Maximal number of persistent worker instances, 0 if command is spawned per request
+    size_t worker_instances;
+    // Worker instance is respawned after serving this many requests, 0 means never
+    size_t worker_recycle;
+    // Seconds before the command is killed, 0 means server default
+    size_t timeout;
+    // Bytes of stdout and of stderr kept per request, 0 means unlimited
+    size_t output_limit;
+    OutputPolicy output_policy;
+
+    CommandConfig() : cache_ttl(0), worker_instances(0), worker_recycle(0), timeout(0),
+        output_limit(0), output_policy(OutputPolicy::head) {}
+};
+
+typedef std::map<std::string, CommandConfig> config_data_type;
 
 typedef std::vector<char> buffer_type;
 
+/* Complete output and waitpid status of one executed command */
+struct CommandResult {
+    buffer_type stdout_data;
+    buffer_type stderr_data;
+    int status;
+
+    CommandResult() : status(0) {}
+};
+
 typedef std::map<pid_t, std::shared_ptr<BaseSession>> dispatcher_type;
 
 /* This struct is a wrapper on synchronization stuff & shared data */
 struct SyncData {
-    const config_data_type& config;
-    boost::shared_mutex& config_mutex;
+    const ConfigStore& config_store;
     dispatcher_type& pid_to_session_map;
     boost::mutex& signal_mutex;
+    ExecutionScheduler& scheduler;
+    ResultCache& result_cache;
+    Metrics& metrics;
+    WorkerPool& worker_pool;
+    JobTable& job_table;
+    TimingWheel& timing_wheel;
 
-    SyncData(const config_data_type& config, 
-        boost::shared_mutex& config_mutex,
+    SyncData(const ConfigStore& config_store,
         dispatcher_type& pid_to_session_map,
-        boost::mutex& signal_mutex) 
-        : config(config),
-        config_mutex(config_mutex),
+        boost::mutex& signal_mutex,
+        ExecutionScheduler& scheduler,
+        ResultCache& result_cache,
+        Metrics& metrics,
+        WorkerPool& worker_pool,
+        JobTable& job_table,
+        TimingWheel& timing_wheel)
+        : config_store(config_store),
         pid_to_session_map(pid_to_session_map),
-        signal_mutex(signal_mutex)
+        signal_mutex(signal_mutex),
+        scheduler(scheduler),
+        result_cache(result_cache),
+        metrics(metrics),
+        worker_pool(worker_pool),
+        job_table(job_table),
+        timing_wheel(timing_wheel)
     {}
 };
 